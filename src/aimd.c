@@ -0,0 +1,138 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transfer.h"
+#include "queue.h"
+#include "aimd.h"
+#include "utime.h"
+
+static off_t aimd_complete_size(info_s *info_ptr) {
+  off_t complete_size = 0;
+  size_t chunk_count = prg_index_chunk_count(info_ptr);
+
+  for (size_t idx = 0; idx < chunk_count; idx++) {
+    complete_size += (off_t)__atomic_load_n(&info_ptr->chunks[idx].size_complete, __ATOMIC_RELAXED);
+  }
+
+  return complete_size;
+}
+
+void aimd_init(info_s *info_ptr) {
+  aimd_s *aimd = &info_ptr->aimd;
+
+  /* Without --max-connections, all connections are always used */
+  if (!info_ptr->params->max_connections) {
+    aimd->target = info_ptr->params->num_connections;
+  }
+
+  /* Set by check_remote_file_size(), but resuming could leave fewer chunks */
+  aimd->target = saldl_min(aimd->target, info_ptr->params->num_connections);
+  aimd->prev_target = aimd->target;
+  aimd->busy = aimd->target;
+  aimd->prev_time = saldl_utime();
+  aimd->prev_complete = aimd_complete_size(info_ptr);
+}
+
+/* Adjust the number of connections given new chunks, called from where chunks are queued.
+ * Like TCP, the number is doubled at first (slow start), then connections are added one
+ * at a time while goodput keeps rising (additive increase). It's cut on 429/503 responses
+ * or when the rate per connection collapses (multiplicative decrease). */
+void aimd_update(info_s *info_ptr) {
+  aimd_s *aimd = &info_ptr->aimd;
+  double now = saldl_utime();
+  double elapsed = now - aimd->prev_time;
+  bool throttled = false;
+  size_t busy = 0;
+
+  if (elapsed < SALDL_AIMD_INTERVAL) {
+    return;
+  }
+
+  for (size_t counter = 0; counter < info_ptr->connections; counter++) {
+    bool conn_busy = false;
+
+    /* Both lanes of a connection with --handoff */
+    for (size_t lane = 0; lane < info_ptr->lanes; lane++) {
+      thread_s *thread = connection_lane(info_ptr, counter, lane);
+
+      if (__atomic_exchange_n(&thread->throttled, false, __ATOMIC_RELAXED)) {
+        throttled = true;
+      }
+
+      if (thread->chunk && thread->chunk->progress < PRG_FINISHED) {
+        conn_busy = true;
+      }
+    }
+
+    busy += conn_busy;
+  }
+
+  off_t complete_size = aimd_complete_size(info_ptr);
+  double rate = (double)saldl_max_o(complete_size - aimd->prev_complete, 0) / elapsed;
+  double conn_rate = busy ? rate / (double)busy : 0;
+  size_t target = aimd->target;
+  size_t new_target = target;
+
+  if (throttled && aimd->hold != SALDL_AIMD_HOLD) {
+    new_target = saldl_max(target / 2, 1);
+    aimd->hold = SALDL_AIMD_HOLD;
+    info_msg(FN, "Server is throttling, connections reduced to %"SAL_ZU".", new_target);
+  }
+  else if (throttled) {
+    /* Responses to requests sent before the last back-off */
+    aimd->hold--;
+  }
+  else if (busy < target) {
+    /* Not enough work left for all connections, the rate says nothing about their number */
+  }
+  else if (aimd->prev_conn_rate && conn_rate < aimd->prev_conn_rate * SALDL_AIMD_COLLAPSE) {
+    new_target = saldl_max(target - target / 4, 1);
+    aimd->hold = SALDL_AIMD_HOLD;
+    info_msg(FN, "Rate per connection collapsed, connections reduced to %"SAL_ZU".", new_target);
+  }
+  else if (target > aimd->prev_target && rate < aimd->prev_rate * (1 + SALDL_AIMD_MIN_GAIN)) {
+    new_target = aimd->prev_target;
+    aimd->hold = SALDL_AIMD_HOLD;
+    debug_msg(FN, "Adding connections did not raise the rate, back to %"SAL_ZU" connections.", new_target);
+  }
+  else if (aimd->hold) {
+    aimd->hold--;
+  }
+  else if (target < info_ptr->params->num_connections) {
+    new_target = aimd->slow_start_done ? target + 1 : saldl_min(target * 2, info_ptr->params->num_connections);
+    debug_msg(FN, "Rate is %.2f%s/s, trying %"SAL_ZU" connections.", human_size(rate), human_size_suffix(rate), new_target);
+  }
+
+  /* Any back-off ends slow start */
+  if (aimd->hold == SALDL_AIMD_HOLD) {
+    aimd->slow_start_done = true;
+  }
+
+  aimd->prev_target = target;
+  aimd->prev_rate = rate;
+  aimd->prev_conn_rate = busy >= target ? conn_rate : 0;
+  aimd->prev_complete = complete_size;
+  aimd->prev_time = now;
+
+  /* Also read by the status thread */
+  __atomic_store_n(&aimd->target, new_target, __ATOMIC_RELAXED);
+  __atomic_store_n(&aimd->busy, busy, __ATOMIC_RELAXED);
+}
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -0,0 +1,29 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SALDL_AIMD_H
+#define SALDL_AIMD_H
+#else
+#error redefining SALDL_AIMD_H
+#endif
+
+void aimd_init(info_s *info_ptr);
+void aimd_update(info_s *info_ptr);
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -31,6 +31,14 @@
 #include <math.h> // for HUGE_VAL
 #include "common.h"
 
+#ifdef HAVE_STATVFS
+#include <sys/statvfs.h>
+#endif
+
+#if defined(HAVE_FALLOCATE) || defined(HAVE_POSIX_FALLOCATE) || defined(HAVE_POSIX_FADVISE) || defined(HAVE_STATVFS)
+#include <fcntl.h>
+#endif
+
 /* .part.sal , .ctrl.sal len is 9 */
 #define SUFFIX_LEN 9
 
@@ -39,7 +47,9 @@ void curl_set_ranges(CURL *handle, chunk_s *chunk) {
   SALDL_ASSERT(chunk->range_end);
   SALDL_ASSERT( (uintmax_t)(chunk->range_end - chunk->range_start) <= (uintmax_t)SIZE_MAX );
   chunk->curr_range_start = chunk->range_start + (off_t)chunk->size_complete;
-  saldl_snprintf(false, range_str, 2 * s_num_digits(OFF_T_MAX) + 1, "%"SAL_JD"-%"SAL_JD"", (intmax_t)chunk->curr_range_start, (intmax_t)chunk->range_end);
+  chunk->curr_range_end = chunk->range_end;
+  chunk->curr_pos = chunk->curr_range_start;
+  saldl_snprintf(false, range_str, 2 * s_num_digits(OFF_T_MAX) + 1, "%"SAL_JD"-%"SAL_JD"", (intmax_t)chunk->curr_range_start, (intmax_t)chunk->curr_range_end);
   curl_easy_setopt(handle, CURLOPT_RANGE, range_str);
 }
 
@@ -92,6 +102,16 @@ void* saldl_malloc(size_t size) {
   return p;
 }
 
+#ifdef HAVE_POSIX_MEMALIGN
+/* 0 size is banned, alignment must be a power of 2 multiple of sizeof(void*) */
+void* saldl_aligned_malloc(size_t alignment, size_t size) {
+  void *p = NULL;
+  SALDL_ASSERT(size);
+  SALDL_ASSERT(!posix_memalign(&p, alignment, size));
+  return p;
+}
+#endif
+
 /* NULL ptr is banned, 0 size is banned */
 void* saldl_realloc(void *ptr, size_t size) {
   void *p = NULL;
@@ -231,7 +251,23 @@ void saldl_fflush(const char *label, FILE *f) {
   }
 }
 
-void saldl_fwrite_fflush(const void *read_buf, size_t size, size_t nmemb, FILE *out_file, const char *out_name, off_t offset_info) {
+/* Fully buffer f, the returned buffer should be freed after f is closed */
+char* saldl_setvbuf(const char *label, FILE *f, size_t size) {
+  char *buf = NULL;
+
+  SALDL_ASSERT(label);
+  SALDL_ASSERT(f);
+
+  buf = saldl_malloc(size);
+
+  if (setvbuf(f, buf, _IOFBF, size)) {
+    fatal(FN, "Setting a buffer of size %"SAL_ZU" for '%s' failed.", size, label);
+  }
+
+  return buf;
+}
+
+void saldl_fwrite(const void *read_buf, size_t size, size_t nmemb, FILE *out_file, const char *out_name, off_t offset_info) {
   size_t ret;
   size_t write_size;
 
@@ -241,8 +277,6 @@ void saldl_fwrite_fflush(const void *read_buf, size_t size, size_t nmemb, FILE *
   SALDL_ASSERT(size * nmemb <= SIZE_MAX);
   SALDL_ASSERT(out_file);
 
-  saldl_fflush(out_name, out_file);
-
   ret = fwrite(read_buf, size, nmemb, out_file);
   write_size = size * nmemb;
 
@@ -256,7 +290,13 @@ void saldl_fwrite_fflush(const void *read_buf, size_t size, size_t nmemb, FILE *
           write_size, out_name, strerror(errno));
     }
   }
+}
 
+void saldl_fwrite_fflush(const void *read_buf, size_t size, size_t nmemb, FILE *out_file, const char *out_name, off_t offset_info) {
+  SALDL_ASSERT(out_file);
+
+  saldl_fflush(out_name, out_file);
+  saldl_fwrite(read_buf, size, nmemb, out_file, out_name, offset_info);
   saldl_fflush(out_name, out_file);
 }
 
@@ -313,6 +353,112 @@ off_t saldl_fsizeo(const char *label, FILE *f) {
   return size;
 }
 
+#ifdef HAVE_PWRITE
+void saldl_pwrite_all(const char *label, int fd, const void *buf, size_t count, off_t offset) {
+  const char *curr = buf;
+
+  SALDL_ASSERT(label);
+  SALDL_ASSERT(buf);
+
+  /* pwrite() is allowed to write less than requested */
+  while (count) {
+    ssize_t ret = pwrite(fd, curr, count, offset);
+
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatal(FN, "Writing %"SAL_ZU" bytes to '%s' failed at offset %"SAL_JD": %s", count, label, (intmax_t)offset, strerror(errno));
+    }
+
+    curr += ret;
+    count -= (size_t)ret;
+    offset += ret;
+  }
+}
+#endif
+
+#ifdef HAVE_FTRUNCATE
+void saldl_ftruncate(const char *label, int fd, off_t size) {
+  SALDL_ASSERT(label);
+
+  if (ftruncate(fd, size)) {
+    fatal(FN, "Setting the size of '%s' to %"SAL_JD" failed: %s", label, (intmax_t)size, strerror(errno));
+  }
+}
+#endif
+
+/* Allocate disk space for the first size bytes of fd, keeping its size if supported,
+ * or if keep_size is set. Returns 0 on success, or an errno value. */
+int saldl_preallocate(int fd, off_t size, bool keep_size) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size)) {
+    return 0;
+  }
+
+  if (errno != EOPNOTSUPP || keep_size) {
+    return errno;
+  }
+#endif
+
+#ifdef HAVE_POSIX_FALLOCATE
+  if (!keep_size) {
+    return posix_fallocate(fd, 0, size);
+  }
+#endif
+
+  (void)fd;
+  (void)size;
+  return EOPNOTSUPP;
+}
+
+#ifdef HAVE_POSIX_FADVISE
+/* Drop fd's cached pages. Dirty pages are written back first, as they can't be dropped. */
+void saldl_drop_cache(const char *label, int fd) {
+  int ret;
+
+#ifdef HAVE_FDATASYNC
+  if (fdatasync(fd)) {
+    warn_msg(FN, "Syncing %s failed: %s", label, strerror(errno));
+  }
+#endif
+
+  if ( (ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) ) {
+    warn_msg(FN, "Dropping cached pages of %s failed: %s", label, strerror(ret));
+  }
+}
+#endif
+
+/* Block size of the filesystem holding file_path, 0 if unknown.
+ * Chunk sizes are set before the part file is created, its directory is checked if it doesn't exist yet. */
+size_t saldl_fs_block_size(const char *file_path) {
+  size_t block_size = 0;
+#ifdef HAVE_STATVFS
+  struct statvfs st;
+  int ret;
+  int fd = open(file_path, O_RDONLY);
+
+  if (fd != -1) {
+    /* The part file could be a symlink to another filesystem */
+    ret = fstatvfs(fd, &st);
+    close(fd);
+  }
+  else {
+    char *path_copy = saldl_strdup(file_path); /* dirname() may modify its argument */
+    ret = statvfs(dirname(path_copy), &st);
+    SALDL_FREE(path_copy);
+  }
+
+  if (!ret) {
+    /* f_bsize is only the preferred I/O size on some filesystems */
+    block_size = (size_t)(st.f_frsize ? st.f_frsize : st.f_bsize);
+  }
+#else
+  (void)file_path;
+#endif
+  return block_size;
+}
+
 off_t saldl_fsize_sys(char *file_path) {
   int ret;
   struct stat st;
@@ -487,6 +633,27 @@ void saldl_unblock_sig_pth() {
 #endif
 }
 
+/* Block the same signals, keeping the previous mask to be restored */
+void saldl_block_sig_pth_save(sigset_t *saved_set) {
+#ifdef HAVE_SIGADDSET
+  sigset_t set;
+  saldl_sigemptyset(&set);
+  saldl_sigaddset(&set, SIGINT);
+  saldl_sigaddset(&set, SIGTERM);
+  saldl_pthread_sigmask(SIG_BLOCK, &set, saved_set);
+#else
+  (void)saved_set;
+#endif
+}
+
+void saldl_restore_sig_pth(const sigset_t *saved_set) {
+#ifdef HAVE_SIGADDSET
+  saldl_pthread_sigmask(SIG_SETMASK, saved_set, NULL);
+#else
+  (void)saved_set;
+#endif
+}
+
 #ifdef HAVE_SIGACTION
 void ignore_sig(int sig, struct sigaction *sa_save) {
   struct sigaction sa_ign;
@@ -605,6 +772,10 @@ size_t saldl_max(size_t a, size_t b) {
   return a > b ? a : b;
 }
 
+off_t saldl_min_o(off_t a, off_t b) {
+  return a < b ? a : b;
+}
+
 off_t saldl_max_o(off_t a, off_t b) {
   return a > b ? a : b;
 }
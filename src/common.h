@@ -48,6 +48,9 @@ char* windows_exe_path();
 char* saldl_lstrip(char *str);
 void* saldl_calloc(size_t nmemb, size_t size);
 void* saldl_malloc(size_t size);
+#ifdef HAVE_POSIX_MEMALIGN
+void* saldl_aligned_malloc(size_t alignment, size_t size);
+#endif
 void* saldl_realloc(void *ptr, size_t size);
 char* saldl_strdup(const char *str);
 int saldl_strcmp(const char *s1, const char *s2);
@@ -57,11 +60,24 @@ void saldl_custom_headers_free_all(char **headers);
 char** saldl_custom_headers_append(char **headers, char *header);
 
 void saldl_fflush(const char *label, FILE *f);
+char* saldl_setvbuf(const char *label, FILE *f, size_t size);
+void saldl_fwrite(const void *read_buf, size_t size, size_t nmemb, FILE *out_file, const char *out_name, off_t offset_info);
 void saldl_fwrite_fflush(const void *read_buf, size_t size, size_t nmemb, FILE *out_file, const char *out_name, off_t offset_info);
 void saldl_fclose(const char *label, FILE *f);
 void saldl_fseeko(const char *label, FILE *f, off_t offset, int whence);
 off_t saldl_ftello(const char *label, FILE *f);
 off_t saldl_fsizeo(const char *label, FILE *f);
+int saldl_preallocate(int fd, off_t size, bool keep_size);
+size_t saldl_fs_block_size(const char *file_path);
+#ifdef HAVE_POSIX_FADVISE
+void saldl_drop_cache(const char *label, int fd);
+#endif
+#ifdef HAVE_PWRITE
+void saldl_pwrite_all(const char *label, int fd, const void *buf, size_t count, off_t offset);
+#endif
+#ifdef HAVE_FTRUNCATE
+void saldl_ftruncate(const char *label, int fd, off_t size);
+#endif
 off_t saldl_fsize_sys(char *file_path);
 time_t saldl_file_mtime(char *file_path);
 int saldl_mkdir(const char *path, mode_t mode);
@@ -73,6 +89,8 @@ void saldl_pthread_mutex_unlock(pthread_mutex_t *mutex);
 
 void saldl_block_sig_pth();
 void saldl_unblock_sig_pth();
+void saldl_block_sig_pth_save(sigset_t *saved_set);
+void saldl_restore_sig_pth(const sigset_t *saved_set);
 
 #ifdef HAVE_SIGADDSET
 void saldl_sigaddset(sigset_t *set, int signum);
@@ -97,6 +115,7 @@ size_t s_num_digits(intmax_t num);
 size_t u_num_digits(uintmax_t num);
 size_t saldl_min(size_t a, size_t b);
 size_t saldl_max(size_t a, size_t b);
+off_t saldl_min_o(off_t a, off_t b);
 off_t saldl_max_o(off_t a, off_t b);
 size_t saldl_max_z_umax(uintmax_t a, uintmax_t b);
 char* saldl_getcwd(char *buf, size_t size);
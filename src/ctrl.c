@@ -19,12 +19,108 @@
 
 #include "events.h"
 #include "ctrl.h"
+#include "utime.h"
+
+/* Binary ctrl files are mapped and updated in place if possible */
+#if defined(HAVE_MMAP) && defined(HAVE_FTRUNCATE)
+#include <sys/mman.h>
+#define SALDL_BINARY_CTRL
+#endif
 
 void ctrl_cleanup_info(ctrl_info_s *ctrl) {
   SALDL_FREE(ctrl->chunks_progress_str);
 }
 
+static void ctrl_get_info_text(FILE *f_ctrl, off_t ctrl_fsize, ctrl_info_s *ctrl) {
+  char *p;
+  char ctrl_file_size_str[s_num_digits(OFF_T_MAX)];
+  char ctrl_chunk_size_str[u_num_digits(SIZE_MAX)];
+  char ctrl_rem_size_str[u_num_digits(SIZE_MAX)];
+
+  /* ctrl_fsize guarantees allocating enough bytes */
+  ctrl->chunks_progress_str = saldl_calloc((size_t)ctrl_fsize, sizeof(char) );
+
+  char *ret_fgets1 = fgets(ctrl_file_size_str, s_num_digits(OFF_T_MAX), f_ctrl);
+  char *ret_fgets2 = fgets(ctrl_chunk_size_str, u_num_digits(SIZE_MAX), f_ctrl);
+  char *ret_fgets3 = fgets(ctrl_rem_size_str, u_num_digits(SIZE_MAX), f_ctrl);
+  char *ret_fgets4 = fgets(ctrl->chunks_progress_str, ctrl_fsize, f_ctrl);
+
+  if (!ret_fgets1 || !ret_fgets2 || !ret_fgets3 || !ret_fgets4) {
+    fatal(FN, "Reading the ctrl file failed. Are you sure it's not corrupt!");
+  }
+
+  if ( fgetc(f_ctrl) != (char)EOF ) {
+    fatal(FN, "ctrl file should have ended here.");
+  }
+
+  if (! ( strchr(ctrl_file_size_str, '\n') && strchr(ctrl_chunk_size_str, '\n') && strchr(ctrl_rem_size_str, '\n') && strchr(ctrl->chunks_progress_str, '\n') ) ) {
+    fatal(FN, "Parsing ctrl file failed.");
+  }
+
+  /* Needed for strtoimax()/strtoumax() in parse_num_o()/parse_num_z()  */
+  p = strchr(ctrl_file_size_str, '\n');
+  *p = '\0';
+  p = strchr(ctrl_chunk_size_str, '\n');
+  *p = '\0';
+  p = strchr(ctrl_rem_size_str, '\n');
+  *p = '\0';
+  p = strchr(ctrl->chunks_progress_str, '\n');
+  *p = '\0';
+
+  ctrl->file_size = parse_num_o(ctrl_file_size_str, 0);
+  ctrl->chunk_size = parse_num_z(ctrl_chunk_size_str, 0);
+  ctrl->rem_size = parse_num_z(ctrl_rem_size_str, 0);
+  ctrl->chunk_count = strlen(ctrl->chunks_progress_str);
+}
+
+static void ctrl_get_info_binary(char *ctrl_filename, FILE *f_ctrl, off_t ctrl_fsize, ctrl_info_s *ctrl) {
+  ctrl_header_s header;
+
+  if (fread(&header, sizeof(header), 1, f_ctrl) != 1) {
+    fatal(FN, "Reading the header of %s failed.", ctrl_filename);
+  }
+
+  if (header.version < SALDL_CTRL_MIN_VERSION || header.version > SALDL_CTRL_VERSION || header.header_size != sizeof(header)) {
+    fatal(FN, "Unsupported ctrl file version %"SAL_JU" in %s.", (uintmax_t)header.version, ctrl_filename);
+  }
+
+  if (header.file_size < 0 || header.chunk_size > SIZE_MAX || header.rem_size > SIZE_MAX ||
+      (uintmax_t)(ctrl_fsize - (off_t)sizeof(header)) != (uintmax_t)header.chunk_count) {
+    fatal(FN, "ctrl file header does not match its size. Are you sure it's not corrupt!");
+  }
+
+  ctrl->file_size = (off_t)header.file_size;
+  ctrl->chunk_size = (size_t)header.chunk_size;
+  ctrl->rem_size = (size_t)header.rem_size;
+  ctrl->chunk_count = (size_t)header.chunk_count;
+
+  /* Converted to the text format, which is what resuming works with */
+  ctrl->chunks_progress_str = saldl_calloc(ctrl->chunk_count + 1, sizeof(char));
+
+  if (fread(ctrl->chunks_progress_str, 1, ctrl->chunk_count, f_ctrl) != ctrl->chunk_count) {
+    fatal(FN, "Reading chunks progress from %s failed.", ctrl_filename);
+  }
+
+  for (size_t idx = 0; idx < ctrl->chunk_count; idx++) {
+    unsigned char prg = (unsigned char)ctrl->chunks_progress_str[idx];
+
+    if (prg > PRG_MERGED && (prg != SALDL_CTRL_PRG_RUN || header.version < 2)) {
+      fatal(FN, "Invalid progress value %u for chunk %"SAL_ZU" in %s.", prg, idx, ctrl_filename);
+    }
+
+    ctrl->chunks_progress_str[idx] = (char)('0' + prg);
+  }
+
+  memcpy(ctrl->etag, header.etag, SALDL_CTRL_VALIDATOR_SIZE);
+  ctrl->etag[SALDL_CTRL_VALIDATOR_SIZE-1] = '\0';
+  memcpy(ctrl->last_modified, header.last_modified, SALDL_CTRL_VALIDATOR_SIZE);
+  ctrl->last_modified[SALDL_CTRL_VALIDATOR_SIZE-1] = '\0';
+}
+
 void ctrl_get_info(char *ctrl_filename, ctrl_info_s *ctrl) {
+  char magic[SALDL_CTRL_MAGIC_SIZE];
+
+  memset(ctrl, 0, sizeof(ctrl_info_s));
 
   if (access(ctrl_filename,F_OK)) {
     /* We are here because we passed --resume, a ctrl file is a must */
@@ -42,76 +138,144 @@ void ctrl_get_info(char *ctrl_filename, ctrl_info_s *ctrl) {
   if (!ctrl_fsize) {
     fatal(FN, "ctrl file is empty.");
   }
+
+  if (ctrl_fsize >= (off_t)sizeof(ctrl_header_s) &&
+      fread(magic, sizeof(magic), 1, f_ctrl) == 1 &&
+      !memcmp(magic, SALDL_CTRL_MAGIC, SALDL_CTRL_MAGIC_SIZE)) {
+    saldl_fseeko(ctrl_filename, f_ctrl, 0, SEEK_SET);
+    ctrl_get_info_binary(ctrl_filename, f_ctrl, ctrl_fsize, ctrl);
+  }
   else {
-    char *p;
-    char ctrl_file_size_str[s_num_digits(OFF_T_MAX)];
-    char ctrl_chunk_size_str[u_num_digits(SIZE_MAX)];
-    char ctrl_rem_size_str[u_num_digits(SIZE_MAX)];
+    saldl_fseeko(ctrl_filename, f_ctrl, 0, SEEK_SET);
+    ctrl_get_info_text(f_ctrl, ctrl_fsize, ctrl);
+  }
+
+  info_msg(FN, "ctrl file parsed:");
+  info_msg(FN, " file_size:  %"SAL_JD"", (intmax_t)ctrl->file_size);
+  info_msg(FN, " chunk_size: %"SAL_ZU"", ctrl->chunk_size);
+  info_msg(FN, " rem_size: %"SAL_ZU"", ctrl->rem_size);
+  info_msg(FN, " chunk_count: %"SAL_ZU"", ctrl->chunk_count);
+  info_msg(FN, " chunks_progress_str: %s", ctrl->chunks_progress_str);
 
-    /* ctrl_fsize guarantees allocating enough bytes */
-    ctrl->chunks_progress_str = saldl_calloc((size_t)ctrl_fsize, sizeof(char) );
+  saldl_fclose(ctrl_filename, f_ctrl);
+}
 
-    char *ret_fgets1 = fgets(ctrl_file_size_str, s_num_digits(OFF_T_MAX), f_ctrl);
-    char *ret_fgets2 = fgets(ctrl_chunk_size_str, u_num_digits(SIZE_MAX), f_ctrl);
-    char *ret_fgets3 = fgets(ctrl_rem_size_str, u_num_digits(SIZE_MAX), f_ctrl);
-    char *ret_fgets4 = fgets(ctrl->chunks_progress_str, ctrl_fsize, f_ctrl);
+#ifdef SALDL_BINARY_CTRL
+static unsigned char ctrl_map_progress(chunk_s *chunk) {
+  /* Appended chunks are set once, their progress is saved with the first chunk of the run */
+  if (chunk->run_leader) {
+    return SALDL_CTRL_PRG_RUN;
+  }
 
-    if (!ret_fgets1 || !ret_fgets2 || !ret_fgets3 || !ret_fgets4) {
-      fatal(FN, "Reading the ctrl file failed. Are you sure it's not corrupt!");
-    }
+  return (unsigned char)chunk_layout_progress(chunk);
+}
+
+static void ctrl_map_sync(info_s *info_ptr, int flags) {
+  control_s *ctrl = &info_ptr->ctrl;
+
+  if (ctrl->sync_start < ctrl->sync_end) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = ctrl->sync_start / page_size * page_size;
 
-    if ( fgetc(f_ctrl) != (char)EOF ) {
-      fatal(FN, "ctrl file should have ended here.");
+    if ( msync(ctrl->map + start, ctrl->sync_end - start, flags) ) {
+      warn_msg(FN, "Flushing %s failed: %s", info_ptr->ctrl_filename, strerror(errno));
     }
+  }
+
+  ctrl->sync_start = SIZE_MAX;
+  ctrl->sync_end = 0;
+  ctrl->last_sync = saldl_utime();
+}
 
-    if (! ( strchr(ctrl_file_size_str, '\n') && strchr(ctrl_chunk_size_str, '\n') && strchr(ctrl_rem_size_str, '\n') && strchr(ctrl->chunks_progress_str, '\n') ) ) {
-      fatal(FN, "Parsing ctrl file failed.");
+/* Only chunks in the changed set are updated, and flushes are batched */
+static void ctrl_map_update(info_s *info_ptr) {
+  control_s *ctrl = &info_ptr->ctrl;
+  unsigned char *chunks_progress = ctrl->map + sizeof(ctrl_header_s);
+  size_t words = (info_ptr->chunk_count + 63) / 64;
+
+  for (size_t word_idx = 0; word_idx < words; word_idx++) {
+    uint64_t changed = prg_index_take_changed(&info_ptr->prg_index, word_idx);
+
+    while (changed) {
+      size_t idx = word_idx * 64 + (size_t)__builtin_ctzll(changed);
+      unsigned char prg = ctrl_map_progress(&info_ptr->chunks[idx]);
+      changed &= changed - 1;
+
+      if (chunks_progress[idx] != prg) {
+        size_t offset = sizeof(ctrl_header_s) + idx;
+        chunks_progress[idx] = prg;
+        ctrl->sync_start = saldl_min(ctrl->sync_start, offset);
+        ctrl->sync_end = saldl_max(ctrl->sync_end, offset + 1);
+      }
     }
+  }
 
-    /* Needed for strtoimax()/strtoumax() in parse_num_o()/parse_num_z()  */
-    p = strchr(ctrl_file_size_str, '\n');
-    *p = '\0';
-    p = strchr(ctrl_chunk_size_str, '\n');
-    *p = '\0';
-    p = strchr(ctrl_rem_size_str, '\n');
-    *p = '\0';
-    p = strchr(ctrl->chunks_progress_str, '\n');
-    *p = '\0';
-
-    ctrl->file_size = parse_num_o(ctrl_file_size_str, 0);
-    ctrl->chunk_size = parse_num_z(ctrl_chunk_size_str, 0);
-    ctrl->rem_size = parse_num_z(ctrl_rem_size_str, 0);
-    ctrl->chunk_count = strlen(ctrl->chunks_progress_str);
-
-    info_msg(FN, "ctrl file parsed:");
-    info_msg(FN, " file_size:  %"SAL_JD"", (intmax_t)ctrl->file_size);
-    info_msg(FN, " chunk_size: %"SAL_ZU"", ctrl->chunk_size);
-    info_msg(FN, " rem_size: %"SAL_ZU"", ctrl->rem_size);
-    info_msg(FN, " chunk_count: %"SAL_ZU"", ctrl->chunk_count);
-    info_msg(FN, " chunks_progress_str: %s", ctrl->chunks_progress_str);
+  if (saldl_utime() - ctrl->last_sync >= SALDL_CTRL_SYNC_INTERVAL) {
+    ctrl_map_sync(info_ptr, MS_ASYNC);
   }
-  saldl_fclose(ctrl_filename, f_ctrl);
 }
 
-static void ctrl_update_cb(evutil_socket_t fd, short what, void *arg) {
-  info_s *info_ptr = arg;
+static void ctrl_map_init(info_s *info_ptr) {
   control_s *ctrl = &info_ptr->ctrl;
-  event_s *ev_ctrl = &info_ptr->ev_ctrl;
+  remote_info_s *remote_info = &info_ptr->remote_info;
+  int fd = fileno(info_ptr->ctrl_file);
+  ctrl_header_s header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SALDL_CTRL_MAGIC, SALDL_CTRL_MAGIC_SIZE);
+  header.version = SALDL_CTRL_VERSION;
+  header.header_size = sizeof(header);
+  header.file_size = info_ptr->file_size;
+  header.chunk_size = info_ptr->params->chunk_size;
+  header.rem_size = info_ptr->rem_size;
+  header.chunk_count = info_ptr->chunk_count;
+
+  if (remote_info->etag) {
+    saldl_snprintf(false, header.etag, SALDL_CTRL_VALIDATOR_SIZE, "%s", remote_info->etag);
+  }
 
-  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s, with what %d", ++ev_ctrl->num_of_calls, str_EVENT_FD(fd) , what);
+  if (remote_info->last_modified) {
+    saldl_snprintf(false, header.last_modified, SALDL_CTRL_VALIDATOR_SIZE, "%s", remote_info->last_modified);
+  }
 
-  /* .part file size will be used to infer progress made in single mode */
-  if (info_ptr->params->single_mode) {
-    events_deactivate(ev_ctrl);
+  ctrl->map_size = sizeof(header) + info_ptr->chunk_count;
+  saldl_ftruncate(info_ptr->ctrl_filename, fd, (off_t)ctrl->map_size);
+
+  ctrl->map = mmap(NULL, ctrl->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ctrl->map == MAP_FAILED) {
+    fatal(FN, "mmap()ing %s failed: %s", info_ptr->ctrl_filename, strerror(errno));
   }
 
-  /* We check if the merge loop is already de-initialized to not lose status of any merged chunks */
-  if ( (info_ptr->session_status == SESSION_INTERRUPTED || !exist_prg(info_ptr, PRG_MERGED, false) ) && info_ptr->ev_merge.event_status < EVENT_INIT) {
-    events_deactivate(ev_ctrl);
+  memcpy(ctrl->map, &header, sizeof(header));
+
+  /* Changes made after this are in the changed set */
+  for (size_t idx = 0; idx < info_ptr->chunk_count; idx++) {
+    ctrl->map[sizeof(header) + idx] = ctrl_map_progress(&info_ptr->chunks[idx]);
+  }
+
+  ctrl->sync_start = 0;
+  ctrl->sync_end = ctrl->map_size;
+  ctrl_map_sync(info_ptr, MS_ASYNC);
+}
+
+static void ctrl_map_deinit(info_s *info_ptr) {
+  control_s *ctrl = &info_ptr->ctrl;
+
+  ctrl_map_update(info_ptr);
+  ctrl_map_sync(info_ptr, MS_SYNC);
+
+  if ( munmap(ctrl->map, ctrl->map_size) ) {
+    warn_msg(FN, "munmap()ing %s failed: %s", info_ptr->ctrl_filename, strerror(errno));
   }
+  ctrl->map = NULL;
+}
+#else
+static void ctrl_text_update(info_s *info_ptr) {
+  control_s *ctrl = &info_ptr->ctrl;
 
+  /* Sub-chunks and appended chunks take the progress of the chunk they belong to */
   for (size_t counter=0; counter < info_ptr->chunk_count; counter++) {
-    memset(&ctrl->raw_status[counter], '0' + info_ptr->chunks[counter].progress, 1);
+    memset(&ctrl->raw_status[counter], '0' + chunk_layout_progress(&info_ptr->chunks[counter]), 1);
   }
 
   saldl_fseeko(info_ptr->ctrl_filename, info_ptr->ctrl_file, ctrl->pos, SEEK_SET);
@@ -122,15 +286,9 @@ static void ctrl_update_cb(evutil_socket_t fd, short what, void *arg) {
   saldl_fflush(info_ptr->ctrl_filename, info_ptr->ctrl_file);
 }
 
-void* sync_ctrl(void *void_info_ptr) {
-  info_s *info_ptr = (info_s*)void_info_ptr;
+static void ctrl_text_init(info_s *info_ptr) {
   control_s *ctrl = &info_ptr->ctrl;
 
-  /* Thread entered */
-  SALDL_ASSERT(info_ptr->ev_ctrl.event_status == EVENT_NULL);
-  info_ptr->ev_ctrl.event_status = EVENT_THREAD_STARTED;
-
-  /* Initialize ctrl */
   /* +1 because saldl_fputs() needs \0 termination to know where to stop */
   ctrl->raw_status = saldl_calloc(info_ptr->chunk_count + 1, sizeof(char));
   memset(ctrl->raw_status,'0', info_ptr->chunk_count);
@@ -155,9 +313,53 @@ void* sync_ctrl(void *void_info_ptr) {
   saldl_fputs(char_rem_size, info_ptr->ctrl_file, info_ptr->ctrl_filename);
   saldl_fputc('\n', info_ptr->ctrl_file, info_ptr->ctrl_filename);
   ctrl->pos = saldl_ftello(info_ptr->ctrl_filename, info_ptr->ctrl_file);
+}
+#endif
+
+static void ctrl_update_cb(void *arg) {
+  info_s *info_ptr = arg;
+  event_s *ev_ctrl = &info_ptr->ev_ctrl;
+
+  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s", ++ev_ctrl->num_of_calls, str_EVENT_ID(ev_ctrl->id));
+
+  /* .part file size will be used to infer progress made in single mode */
+  if (info_ptr->params->single_mode) {
+    events_deactivate(ev_ctrl);
+  }
+
+  /* We check if the merge loop is already de-initialized to not lose status of any merged chunks */
+  if ( (info_ptr->session_status == SESSION_INTERRUPTED || !exist_prg(info_ptr, PRG_MERGED, false) ) && info_ptr->ev_merge.event_status < EVENT_INIT) {
+    events_deactivate(ev_ctrl);
+  }
+
+#ifdef SALDL_BINARY_CTRL
+  ctrl_map_update(info_ptr);
+#else
+  ctrl_text_update(info_ptr);
+#endif
+}
+
+void* sync_ctrl(void *void_info_ptr) {
+  info_s *info_ptr = (info_s*)void_info_ptr;
+
+  /* Thread entered */
+  SALDL_ASSERT(info_ptr->ev_ctrl.event_status == EVENT_NULL);
+  info_ptr->ev_ctrl.event_status = EVENT_THREAD_STARTED;
+
+  /* Initialize ctrl */
+#ifdef SALDL_BINARY_CTRL
+  ctrl_map_init(info_ptr);
+
+  /* Also woken up if no chunk progress is set in time, so the last changes are flushed during a stall */
+  uint64_t sync_usec = (uint64_t)(SALDL_CTRL_SYNC_INTERVAL * 1000000);
+  info_ptr->ev_ctrl.tv.tv_sec = sync_usec / 1000000;
+  info_ptr->ev_ctrl.tv.tv_usec = sync_usec % 1000000;
+#else
+  ctrl_text_init(info_ptr);
+#endif
 
   /* event loop */
-  events_init(&info_ptr->ev_ctrl, ctrl_update_cb, info_ptr, EVENT_CTRL);
+  events_init(&info_ptr->ev_ctrl, ctrl_update_cb, info_ptr);
 
   if (info_ptr->session_status != SESSION_INTERRUPTED && exist_prg(info_ptr, PRG_MERGED, false)) {
     debug_msg(FN, "Start ev_ctrl loop.");
@@ -168,7 +370,11 @@ void* sync_ctrl(void *void_info_ptr) {
   events_deinit(&info_ptr->ev_ctrl);
 
   /* finalize and cleanup */
-  SALDL_FREE(ctrl->raw_status);
+#ifdef SALDL_BINARY_CTRL
+  ctrl_map_deinit(info_ptr);
+#else
+  SALDL_FREE(info_ptr->ctrl.raw_status);
+#endif
   return info_ptr;
 }
 
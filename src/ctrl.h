@@ -23,12 +23,41 @@
 #error redefining SALDL_CTRL_H
 #endif
 
+/* Binary ctrl files start with this header, followed by the progress of
+ * each chunk in a byte. Fields are saved in native byte order. Old text
+ * ctrl files (file_size, chunk_size, rem_size & a progress char per chunk,
+ * each on a line) are still read.
+ * Since version 2, chunks appended to the range of the previous one with
+ * --adaptive-chunks are saved as SALDL_CTRL_PRG_RUN. The progress of such
+ * a variable-size chunk is the progress of its first chunk.
+ */
+#define SALDL_CTRL_MAGIC "SALDLCTL"
+#define SALDL_CTRL_MAGIC_SIZE 8
+#define SALDL_CTRL_VERSION 2
+#define SALDL_CTRL_MIN_VERSION 1
+#define SALDL_CTRL_PRG_RUN (CH_PRG_RUN - CH_PRG_NOT_STARTED)
+#define SALDL_CTRL_VALIDATOR_SIZE 128
+
+typedef struct {
+  char magic[SALDL_CTRL_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t header_size;
+  int64_t file_size;
+  uint64_t chunk_size;
+  uint64_t rem_size;
+  uint64_t chunk_count;
+  char etag[SALDL_CTRL_VALIDATOR_SIZE];
+  char last_modified[SALDL_CTRL_VALIDATOR_SIZE];
+} ctrl_header_s;
+
 typedef struct {
  off_t file_size;
  size_t chunk_size;
  size_t rem_size;
  size_t chunk_count;
  char* chunks_progress_str;
+ char etag[SALDL_CTRL_VALIDATOR_SIZE]; /* empty if not saved */
+ char last_modified[SALDL_CTRL_VALIDATOR_SIZE]; /* empty if not saved */
 }  ctrl_info_s;
 
 
@@ -45,7 +45,35 @@
 #define SALDL_DEF_NUM_CONNECTIONS 6
 #endif
 
+#ifndef SALDL_DEF_WRITE_BUFFER_SIZE
+#define SALDL_DEF_WRITE_BUFFER_SIZE 1*1024*1024 /* 1.00 MiB */
+#endif
+
 /* Constants */
 #define SALDL_STATUS_INITIAL_INTERVAL 0.5
+#define SALDL_STEAL_MIN_SIZE 64*1024 /* 64.00 KiB */
+#define SALDL_STEAL_MAX_SUB_CHUNKS_PER_CONNECTION 8
+#define SALDL_HEDGE_MIN_SIZE 64*1024 /* 64.00 KiB */
+#define SALDL_HEDGE_MAX_SUB_CHUNKS_PER_CONNECTION 4
+#define SALDL_EVICT_SAMPLE_INTERVAL 0.5 /* seconds between throughput samples of a connection */
+#define SALDL_EVICT_ACTIVE_TIME 2.0 /* seconds since the last sample of a connection still counted as active */
+#define SALDL_EVICT_EWMA_WEIGHT 0.3 /* weight of the latest sample */
+#define SALDL_EVICT_SLOW_RATIO 8 /* evict connections slower than median/ratio */
+#define SALDL_EVICT_MIN_PEERS 3 /* active connections needed for a meaningful median */
+#define SALDL_EVICT_MIN_SIZE 64*1024 /* 64.00 KiB, not worth reconnecting for less */
+#define SALDL_AIMD_INTERVAL 2.0 /* seconds between updates of the number of connections */
+#define SALDL_AIMD_MIN_GAIN 0.05 /* an added connection must raise goodput by this fraction to be kept */
+#define SALDL_AIMD_COLLAPSE 0.5 /* back off if the rate per connection drops below this fraction of the last one */
+#define SALDL_AIMD_HOLD 5 /* updates to wait before adding connections again after backing off */
+#define SALDL_ADAPTIVE_DEF_CHUNK_SIZE 256*1024 /* 256.00 KiB, chunks are appended to each other to form requests */
+#define SALDL_ADAPTIVE_MIN_SAMPLE 64*1024 /* 64.00 KiB, transfers smaller than this don't update the rate */
+#define SALDL_ADAPTIVE_EWMA_WEIGHT 0.5 /* weight of the latest transfer */
+#define SALDL_ADAPTIVE_RTTS 8 /* requests last at least this many times the time to the first byte */
+#define SALDL_CTRL_SYNC_INTERVAL 1.0 /* seconds between flushes of ctrl file changes */
+#define SALDL_MEM_POOL_SPARE_PER_CONNECTION 1 /* free chunk buffers kept for reuse, without a memory buffers limit */
+#define SALDL_MEM_POOL_MMAP_MIN_SIZE 2*1024*1024 /* 2.00 MiB, the usual huge page size */
+#define SALDL_SPLICED_DRAIN_POLL_MS 100 /* ms between checks for the stdout pipe being read, before lent buffers are freed */
+#define SALDL_URING_BUFS_PER_CONNECTION 4 /* write buffers a connection can fill while earlier ones are written */
+#define SALDL_PREWARM_TIMEOUT 30l /* seconds a warm-up request is allowed to take */
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -19,25 +19,70 @@
 
 #include "events.h"
 
+static event_s* event_loop(info_s *info_ptr, enum EVENT_ID id) {
+  switch (id) {
+    case EVENT_STATUS:
+      return &info_ptr->ev_status;
+    case EVENT_CTRL:
+      return &info_ptr->ev_ctrl;
+    case EVENT_MERGE_FINISHED:
+      return &info_ptr->ev_merge;
+    case EVENT_QUEUE:
+      return &info_ptr->ev_queue;
+    case EVENT_MAX:
+      break;
+  }
+  return NULL;
+}
+
+/* Called once, before any chunk progress is set */
+void events_setup(info_s *info_ptr) {
+  events_s *events = &info_ptr->events;
+
+  SALDL_ASSERT(!pthread_mutex_init(&events->mutex, NULL));
+  SALDL_ASSERT(!pthread_mutex_init(&events->done_mutex, NULL));
+  SALDL_ASSERT(!pthread_cond_init(&events->done_cond, NULL));
+
+  for (enum EVENT_ID id = 0; id < EVENT_MAX; id++) {
+    event_s *ev_this = event_loop(info_ptr, id);
+    SALDL_ASSERT(!pthread_cond_init(&ev_this->ev_cond, NULL));
+    ev_this->id = id;
+    ev_this->events = events;
+    events->loops[id] = ev_this;
+  }
+}
+
+void events_free(info_s *info_ptr) {
+  events_s *events = &info_ptr->events;
+
+  for (enum EVENT_ID id = 0; id < EVENT_MAX; id++) {
+    SALDL_ASSERT(!pthread_cond_destroy(&events->loops[id]->ev_cond));
+  }
+
+  SALDL_ASSERT(!pthread_cond_destroy(&events->done_cond));
+  SALDL_ASSERT(!pthread_mutex_destroy(&events->done_mutex));
+  SALDL_ASSERT(!pthread_mutex_destroy(&events->mutex));
+}
+
 void join_event_pth(event_s *ev_this, pthread_t *event_thread_id) {
   if (ev_this->event_status > EVENT_NULL) {
 
     pthread_t calling_thread_id = pthread_self();
     if (calling_thread_id == *event_thread_id) {
-      warn_msg(FN, "%s thread tried to join itself, detaching instead.", str_EVENT_FD(ev_this->vFD));
+      warn_msg(FN, "%s thread tried to join itself, detaching instead.", str_EVENT_ID(ev_this->id));
       pthread_detach(*event_thread_id);
     }
     else {
       saldl_pthread_join_accept_einval(*event_thread_id, NULL);
     }
 
-    debug_event_msg(FN, "Setting %s status to EVENT_NULL.", str_EVENT_FD(ev_this->vFD));
+    debug_event_msg(FN, "Setting %s status to EVENT_NULL.", str_EVENT_ID(ev_this->id));
     ev_this->event_status = EVENT_NULL;
   }
 }
 
-const char* str_EVENT_FD (enum EVENT_FD fd) {
-  switch (fd) {
+const char* str_EVENT_ID (enum EVENT_ID id) {
+  switch (id) {
     case EVENT_STATUS:
       return "EVENT_STATUS";
     case EVENT_CTRL:
@@ -46,178 +91,147 @@ const char* str_EVENT_FD (enum EVENT_FD fd) {
       return "EVENT_MERGE_FINISHED";
     case EVENT_QUEUE:
       return "EVENT_QUEUE";
-    case EVENT_TRIGGER:
-      return "EVENT_TRIGGER";
-    case EVENT_NONE:
-      return "EVENT_NONE";
+    case EVENT_MAX:
+      return "EVENT_MAX";
   }
   return "";
 }
 
-void events_init(event_s *ev_this, event_callback_fn cb, void *cb_data, enum EVENT_FD vFD) {
+void events_init(event_s *ev_this, event_cb_fn cb, void *cb_data) {
   SALDL_ASSERT(ev_this->event_status == EVENT_THREAD_STARTED);
+  SALDL_ASSERT(ev_this->events);
 
-  debug_event_msg(FN, "Init %s.", str_EVENT_FD(vFD));
+  debug_event_msg(FN, "Init %s.", str_EVENT_ID(ev_this->id));
 
   /* Don't interrupt event threads, they will react to SESSION interrupted and exit cleanly */
   saldl_block_sig_pth();
 
-  /* initialize mutex */
-  SALDL_ASSERT(!pthread_mutexattr_init(&ev_this->ev_mutex_attr));
-  SALDL_ASSERT(!pthread_mutexattr_settype(&ev_this->ev_mutex_attr, PTHREAD_MUTEX_ERRORCHECK));
-  SALDL_ASSERT(!pthread_mutex_init(&ev_this->ev_mutex, &ev_this->ev_mutex_attr));
+  ev_this->cb = cb;
+  ev_this->cb_data = cb_data;
+
+  /* Initialization done */
+  ev_this->event_status = EVENT_INIT;
+}
+
+/* Returns with the mutex locked, after a notification or a time-out */
+static void event_wait(event_s *ev_this) {
+  events_s *events = ev_this->events;
+  unsigned bit = EVENT_BIT(ev_this->id);
 
-  /* Max time-out between events */
-  if (!ev_this->tv.tv_sec && !ev_this->tv.tv_usec) { // keep tv as-is if it's already set
-    ev_this->tv = (struct timeval) { .tv_sec = 0, .tv_usec = 500000 };
+  if (!ev_this->tv.tv_sec && !ev_this->tv.tv_usec) {
+    while (!(events->dirty & bit)) {
+      SALDL_ASSERT(!pthread_cond_wait(&ev_this->ev_cond, &events->mutex));
+    }
+    return;
   }
 
-  /* setup event base and the event itself */
-  ev_this->ev_b = event_base_new();
-  SALDL_ASSERT(ev_this->ev_b);
-  ev_this->vFD = vFD;
-  ev_this->ev = event_new(ev_this->ev_b, vFD, EV_WRITE|EV_PERSIST, cb, cb_data);
+  struct timeval now;
+  SALDL_ASSERT(!gettimeofday(&now, NULL));
 
-  /* Add the event with tv as max time-out */
-  SALDL_ASSERT(!event_add(ev_this->ev, &ev_this->tv));
+  long usec = (long)now.tv_usec + (long)ev_this->tv.tv_usec;
+  struct timespec ts = {
+    .tv_sec = now.tv_sec + ev_this->tv.tv_sec + usec / 1000000,
+    .tv_nsec = (usec % 1000000) * 1000
+  };
 
-  /* Initialization done */
-  ev_this->event_status = EVENT_INIT;
+  while (!(events->dirty & bit)) {
+    int ret = pthread_cond_timedwait(&ev_this->ev_cond, &events->mutex, &ts);
+    if (ret == ETIMEDOUT) {
+      return;
+    }
+    SALDL_ASSERT(!ret);
+  }
 }
 
 void events_activate(event_s *ev_this) {
+  events_s *events = ev_this->events;
+  unsigned bit = EVENT_BIT(ev_this->id);
+
   SALDL_ASSERT(ev_this->event_status == EVENT_INIT);
-  debug_event_msg(FN, "Activating %s.", str_EVENT_FD(ev_this->vFD));
+  debug_event_msg(FN, "Activating %s.", str_EVENT_ID(ev_this->id));
+
+  saldl_pthread_mutex_lock_retry_deadlock(&events->mutex);
   ev_this->event_status = EVENT_ACTIVE;
-  SALDL_ASSERT(event_base_loop(ev_this->ev_b, 0) >= 0);
+
+  /* Notifications sent before the loop started are pending, run once anyway */
+  events->dirty |= bit;
+
+  /* Like a loop exit, a deactivated event still finishes its running callback */
+  while (ev_this->event_status == EVENT_ACTIVE) {
+    event_wait(ev_this);
+    events->dirty &= ~bit;
+
+    saldl_pthread_mutex_unlock(&events->mutex);
+    ev_this->cb(ev_this->cb_data);
+    saldl_pthread_mutex_lock_retry_deadlock(&events->mutex);
+  }
+
+  saldl_pthread_mutex_unlock(&events->mutex);
 }
 
 void events_deactivate(event_s *ev_this) {
+  events_s *events = ev_this->events;
+
   SALDL_ASSERT(ev_this->event_status >= EVENT_INIT);
-  saldl_pthread_mutex_lock_retry_deadlock(&ev_this->ev_mutex);
+  saldl_pthread_mutex_lock_retry_deadlock(&events->mutex);
 
-  /* Check if not already deactivated. Remember that active events will
-   * run, even after calling event_base_loopexit(). */
+  /* Check if not already deactivated */
   if (ev_this->event_status == EVENT_ACTIVE) {
-    debug_event_msg(FN, "Deactivating %s.", str_EVENT_FD(ev_this->vFD));
+    debug_event_msg(FN, "Deactivating %s.", str_EVENT_ID(ev_this->id));
 
-    /* Stop triggering events */
+    /* The loop exits after the current callback returns, or when woken up if it's waiting */
     ev_this->event_status = EVENT_INIT;
-
-    /* Unlike loopbreak, this will run all active events before exiting */
-    SALDL_ASSERT(!event_base_loopexit(ev_this->ev_b, NULL));
+    events->dirty |= EVENT_BIT(ev_this->id);
+    SALDL_ASSERT(!pthread_cond_broadcast(&ev_this->ev_cond));
   }
 
-  saldl_pthread_mutex_unlock(&ev_this->ev_mutex);
+  saldl_pthread_mutex_unlock(&events->mutex);
 }
 
 void events_deinit(event_s *ev_this) {
   SALDL_ASSERT(ev_this->event_status == EVENT_INIT);
-  saldl_pthread_mutex_lock_retry_deadlock(&ev_this->ev_mutex);
-
-  debug_event_msg(FN, "De-init %s.", str_EVENT_FD(ev_this->vFD));
 
-  /* Free libevent structs */
-  event_free(ev_this->ev);
-  ev_this->ev = NULL;
-  event_base_free(ev_this->ev_b);
-  ev_this->ev_b = NULL;
+  debug_event_msg(FN, "De-init %s.", str_EVENT_ID(ev_this->id));
 
+  ev_this->cb = NULL;
+  ev_this->cb_data = NULL;
   ev_this->event_status = EVENT_THREAD_STARTED;
-
-  /* Unlock and destroy mutex */
-  saldl_pthread_mutex_unlock(&ev_this->ev_mutex);
-  SALDL_ASSERT(!pthread_mutex_destroy(&ev_this->ev_mutex));
-  SALDL_ASSERT(!pthread_mutexattr_destroy(&ev_this->ev_mutex_attr));
 }
 
-static void event_trigger(event_s *ev_this) {
-  saldl_block_sig_pth();
+/* Wake up the loops in mask. Repeated notifications before a loop runs are coalesced into one callback.
+ * The signal handler queues events too, in exit_routine(). So, signals must be blocked in the calling
+ * thread. Event loops and transfer threads block them when they start, the main thread in saldl(). */
+void event_queue(events_s *events, unsigned mask) {
+  saldl_pthread_mutex_lock_retry_deadlock(&events->mutex);
 
-  if (ev_this && ev_this->event_status == EVENT_ACTIVE) {
-    saldl_pthread_mutex_lock_retry_deadlock(&ev_this->ev_mutex);
+  unsigned newly_dirty = mask & ~events->dirty;
+  events->dirty |= mask;
 
-    /* We check for EVENT_ACTIVE again in mutex lock to avoid races with deactivation code */
-    if ( ev_this->event_status == EVENT_ACTIVE) {
-      debug_event_msg(FN, "Triggering %s.", str_EVENT_FD(ev_this->vFD));
-      event_active(ev_this->ev, EV_WRITE|EV_PERSIST, 1);
+  for (enum EVENT_ID id = 0; id < EVENT_MAX; id++) {
+    if (newly_dirty & EVENT_BIT(id)) {
+      debug_event_msg(FN, "Triggering %s.", str_EVENT_ID(id));
+      SALDL_ASSERT(!pthread_cond_signal(&events->loops[id]->ev_cond));
     }
-
-    /* Before unlocking the mutex, make sure event wasn't de-initialized somehow. */
-    if (ev_this->event_status >= EVENT_INIT) {
-      saldl_pthread_mutex_unlock(&ev_this->ev_mutex);
-    }
-  }
-  saldl_unblock_sig_pth();
-}
-
-void event_queue(event_s *ev_trigger, event_s *ev_to_queue) {
-  if (ev_to_queue) ev_to_queue->queued += 1;
-  event_trigger(ev_trigger);
-}
-
-static void events_check_queues(info_s *info_ptr) {
-  if (info_ptr->ev_queue.queued) {
-    event_trigger(&info_ptr->ev_queue);
-    info_ptr->ev_queue.queued -= 1;
-    SALDL_ASSERT(info_ptr->ev_queue.queued >= 0);
   }
 
-  if (info_ptr->ev_ctrl.queued) {
-    event_trigger(&info_ptr->ev_ctrl);
-    info_ptr->ev_ctrl.queued -= 1;
-    SALDL_ASSERT(info_ptr->ev_ctrl.queued >= 0);
-  }
-
-  if (info_ptr->ev_merge.queued) {
-    event_trigger(&info_ptr->ev_merge);
-    info_ptr->ev_merge.queued -= 1;
-    SALDL_ASSERT(info_ptr->ev_merge.queued >= 0);
-  }
-
-  if (info_ptr->ev_status.queued) {
-    event_trigger(&info_ptr->ev_status);
-    info_ptr->ev_status.queued -= 1;
-    SALDL_ASSERT(info_ptr->ev_status.queued >= 0);
-  }
+  saldl_pthread_mutex_unlock(&events->mutex);
 }
 
-static void events_trigger_next_cb(evutil_socket_t fd, short what, void *arg) {
-  info_s *info_ptr = arg;
-  event_s *ev_trigger = &info_ptr->ev_trigger;
-
-  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s, with what %d", ++ev_trigger->num_of_calls, str_EVENT_FD(fd) , what);
-
-  if (info_ptr->events_queue_done) {
-    events_deactivate(ev_trigger);
-  }
-
-  events_check_queues(info_ptr);
+/* Wake up the main thread, all chunks reached their final progress */
+void events_done(events_s *events) {
+  saldl_pthread_mutex_lock_retry_deadlock(&events->done_mutex);
+  events->done = true;
+  SALDL_ASSERT(!pthread_cond_signal(&events->done_cond));
+  saldl_pthread_mutex_unlock(&events->done_mutex);
 }
 
-void* events_trigger_thread(void *void_info_ptr) {
-  info_s *info_ptr = (info_s*)void_info_ptr;
-
-  /* Thread entered */
-  SALDL_ASSERT(info_ptr->ev_trigger.event_status == EVENT_NULL);
-  info_ptr->ev_trigger.event_status = EVENT_THREAD_STARTED;
-
-  /* event loop */
-  /* No need to run this every .5 sec, external triggers are enough */
-  info_ptr->ev_trigger.tv =  (struct timeval) { .tv_sec = 3, .tv_usec = 0 };
-  events_init(&info_ptr->ev_trigger, events_trigger_next_cb, info_ptr, EVENT_TRIGGER);
-
-  if (!info_ptr->events_queue_done) {
-    debug_msg(FN, "Start ev_trigger loop.");
-    events_activate(&info_ptr->ev_trigger);
+/* Signals are not blocked here, interrupting the main thread runs exit_routine() */
+void events_wait_done(events_s *events) {
+  saldl_pthread_mutex_lock_retry_deadlock(&events->done_mutex);
+  while (!events->done) {
+    SALDL_ASSERT(!pthread_cond_wait(&events->done_cond, &events->done_mutex));
   }
-
-  events_check_queues(info_ptr);
-
-  /* Event loop exited */
-  events_deinit(&info_ptr->ev_trigger);
-
-  return info_ptr;
+  saldl_pthread_mutex_unlock(&events->done_mutex);
 }
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -25,13 +25,16 @@
 
 #include "transfer.h"
 
+void events_setup(info_s *info_ptr);
+void events_free(info_s *info_ptr);
 void join_event_pth(event_s *ev_this, pthread_t *event_thread_id);
-const char* str_EVENT_FD (enum EVENT_FD fd);
-void events_init(event_s *ev_this, event_callback_fn cb, void *cb_data, enum EVENT_FD vFD);
+const char* str_EVENT_ID (enum EVENT_ID id);
+void events_init(event_s *ev_this, event_cb_fn cb, void *cb_data);
 void events_activate(event_s *ev_this);
 void events_deactivate(event_s *ev_this);
 void events_deinit(event_s *ev_this);
-void event_queue(event_s *ev_trigger, event_s *ev_to_queue);
-void* events_trigger_thread(void *void_info_ptr);
+void event_queue(events_s *events, unsigned mask);
+void events_done(events_s *events);
+void events_wait_done(events_s *events);
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -66,32 +66,27 @@ void exit_routine() {
     if (info_global->session_status >= SESSION_IN_PROGRESS) {
       /* Interrupt & stop queue events 1st */
       info_global->session_status = SESSION_QUEUE_INTERRUPTED;
-      event_queue(&info_global->ev_trigger, &info_global->ev_queue);
+      event_queue(&info_global->events, EVENT_BIT(EVENT_QUEUE));
 
       join_event_pth(&info_global->ev_queue, &info_global->queue_next_pth);
 
       /* Trigger events. merge & ctrl are important for resume */
-      event_queue(&info_global->ev_trigger, &info_global->ev_merge);
-      event_queue(&info_global->ev_trigger, &info_global->ev_ctrl);
-      event_queue(&info_global->ev_trigger, &info_global->ev_status);
+      event_queue(&info_global->events, EVENT_PROGRESS_MASK & ~EVENT_BIT(EVENT_QUEUE));
 
       /* Set session_status to SESSION_INTERRUPTED  to break out of all event loops */
       info_global->session_status = SESSION_INTERRUPTED;
 
       /* Trigger events after updating session_status! */
-      event_queue(&info_global->ev_trigger, &info_global->ev_merge);
-      event_queue(&info_global->ev_trigger, &info_global->ev_ctrl);
-      event_queue(&info_global->ev_trigger, &info_global->ev_status);
+      event_queue(&info_global->events, EVENT_PROGRESS_MASK & ~EVENT_BIT(EVENT_QUEUE));
 
       /* Join remaining event threads */
       join_event_pth(&info_global->ev_merge, &info_global->merger_pth);
+
+      /* ctrl and status wait for the merge loop to exit, which could be the one calling us */
+      event_queue(&info_global->events, EVENT_BIT(EVENT_CTRL)|EVENT_BIT(EVENT_STATUS));
+
       join_event_pth(&info_global->ev_ctrl, &info_global->sync_ctrl_pth);
       join_event_pth(&info_global->ev_status, &info_global->status_display_pth);
-
-      /* Join ev_trigger thread */
-      info_global->events_queue_done = true;
-      event_queue(&info_global->ev_trigger, NULL);
-      join_event_pth(&info_global->ev_trigger, &info_global->trigger_events_pth);
     }
 
   }
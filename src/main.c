@@ -153,6 +153,28 @@ static int parse_opts(saldl_params *params_ptr, int full_argc, char **full_argv)
 #define SAL_OPT_TIMEOUT_LOW_SPEED         CHAR_MAX+19
 #define SAL_OPT_TIMEOUT_LOW_SPEED_PERIOD  CHAR_MAX+20
 #define SAL_OPT_TIMEOUT_CONNECTION_PERIOD CHAR_MAX+21
+#define SAL_OPT_MULTI_INTERFACE           CHAR_MAX+22
+#define SAL_OPT_DIRECT_WRITES             CHAR_MAX+23
+#define SAL_OPT_WORK_STEALING             CHAR_MAX+24
+#define SAL_OPT_ZERO_PROBE                CHAR_MAX+25
+#define SAL_OPT_REORDER_WINDOW            CHAR_MAX+26
+#define SAL_OPT_MEMORY_BUFFERS_LIMIT      CHAR_MAX+27
+#define SAL_OPT_WRITE_BUFFER_SIZE         CHAR_MAX+28
+#define SAL_OPT_MERGE_WORKERS             CHAR_MAX+29
+#define SAL_OPT_NO_PREALLOCATE            CHAR_MAX+30
+#define SAL_OPT_IO_URING                  CHAR_MAX+31
+#define SAL_OPT_O_DIRECT                  CHAR_MAX+32
+#define SAL_OPT_DROP_CACHE                CHAR_MAX+33
+#define SAL_OPT_MMAP_WRITES               CHAR_MAX+34
+#define SAL_OPT_ENDGAME                   CHAR_MAX+35
+#define SAL_OPT_EVICT_SLOW                CHAR_MAX+36
+#define SAL_OPT_MAX_CONNECTIONS           CHAR_MAX+37
+#define SAL_OPT_ADAPTIVE_CHUNKS           CHAR_MAX+38
+#define SAL_OPT_HANDOFF                   CHAR_MAX+39
+#define SAL_OPT_HANDOFF_TIME              CHAR_MAX+40
+#define SAL_OPT_MULTIPLEX                 CHAR_MAX+41
+#define SAL_OPT_PREWARM                   CHAR_MAX+42
+#define SAL_OPT_TCP_FASTOPEN              CHAR_MAX+43
     {"mirror-url", required_argument, 0, SAL_OPT_MIRROR_URL},
     {"fatal-if-invalid-mirror", no_argument, 0, SAL_OPT_FATAL_IF_INVALID_MIRROR},
     {"no-http2", no_argument, 0, SAL_OPT_NO_HTTP2},
@@ -174,6 +196,28 @@ static int parse_opts(saldl_params *params_ptr, int full_argc, char **full_argv)
     {"timeout-low-speed", required_argument, 0, SAL_OPT_TIMEOUT_LOW_SPEED},
     {"timeout-low-speed-period", required_argument, 0, SAL_OPT_TIMEOUT_LOW_SPEED_PERIOD},
     {"timeout-connection-period", required_argument, 0, SAL_OPT_TIMEOUT_CONNECTION_PERIOD},
+    {"multi-interface", no_argument, 0, SAL_OPT_MULTI_INTERFACE},
+    {"direct-writes", no_argument, 0, SAL_OPT_DIRECT_WRITES},
+    {"work-stealing", no_argument, 0, SAL_OPT_WORK_STEALING},
+    {"zero-probe", no_argument, 0, SAL_OPT_ZERO_PROBE},
+    {"reorder-window", required_argument, 0, SAL_OPT_REORDER_WINDOW},
+    {"memory-buffers-limit", required_argument, 0, SAL_OPT_MEMORY_BUFFERS_LIMIT},
+    {"write-buffer-size", required_argument, 0, SAL_OPT_WRITE_BUFFER_SIZE},
+    {"merge-workers", required_argument, 0, SAL_OPT_MERGE_WORKERS},
+    {"no-preallocate", no_argument, 0, SAL_OPT_NO_PREALLOCATE},
+    {"io-uring", no_argument, 0, SAL_OPT_IO_URING},
+    {"o-direct", no_argument, 0, SAL_OPT_O_DIRECT},
+    {"drop-cache", no_argument, 0, SAL_OPT_DROP_CACHE},
+    {"mmap-writes", no_argument, 0, SAL_OPT_MMAP_WRITES},
+    {"endgame", no_argument, 0, SAL_OPT_ENDGAME},
+    {"evict-slow", required_argument, 0, SAL_OPT_EVICT_SLOW},
+    {"max-connections", required_argument, 0, SAL_OPT_MAX_CONNECTIONS},
+    {"adaptive-chunks", required_argument, 0, SAL_OPT_ADAPTIVE_CHUNKS},
+    {"handoff", required_argument, 0, SAL_OPT_HANDOFF},
+    {"handoff-time", required_argument, 0, SAL_OPT_HANDOFF_TIME},
+    {"multiplex", required_argument, 0, SAL_OPT_MULTIPLEX},
+    {"prewarm", no_argument, 0, SAL_OPT_PREWARM},
+    {"tcp-fastopen", no_argument, 0, SAL_OPT_TCP_FASTOPEN},
     {0, 0, 0, 0}
   };
 
@@ -431,6 +475,101 @@ static int parse_opts(saldl_params *params_ptr, int full_argc, char **full_argv)
         params_ptr->timeout_connection_period = parse_num_z(optarg, 0);
         break;
 
+      case SAL_OPT_MULTI_INTERFACE:
+        params_ptr->multi_interface = true;
+        break;
+
+      case SAL_OPT_DIRECT_WRITES:
+        params_ptr->direct_writes = true;
+        break;
+
+      case SAL_OPT_WORK_STEALING:
+        params_ptr->work_stealing = true;
+        break;
+
+      case SAL_OPT_ZERO_PROBE:
+        params_ptr->zero_probe = true;
+        break;
+
+      case SAL_OPT_REORDER_WINDOW:
+        params_ptr->reorder_window = parse_num_o(optarg, 1);
+        break;
+
+      case SAL_OPT_MEMORY_BUFFERS_LIMIT:
+        params_ptr->mem_bufs_limit = parse_num_o(optarg, 1);
+        break;
+
+      case SAL_OPT_WRITE_BUFFER_SIZE:
+        params_ptr->write_buf_size = parse_num_z(optarg, 1);
+        break;
+
+      case SAL_OPT_MERGE_WORKERS:
+        params_ptr->merge_workers = parse_num_z(optarg, 0);
+        break;
+
+      case SAL_OPT_NO_PREALLOCATE:
+        params_ptr->no_preallocate = true;
+        break;
+
+      case SAL_OPT_IO_URING:
+        params_ptr->io_uring = true;
+        params_ptr->direct_writes = true;
+        break;
+
+      case SAL_OPT_O_DIRECT:
+        params_ptr->o_direct = true;
+        params_ptr->direct_writes = true;
+        break;
+
+      case SAL_OPT_DROP_CACHE:
+        params_ptr->drop_cache = true;
+        break;
+
+      case SAL_OPT_MMAP_WRITES:
+        params_ptr->mmap_writes = true;
+        params_ptr->direct_writes = true;
+        break;
+
+      case SAL_OPT_ENDGAME:
+        params_ptr->endgame = true;
+        params_ptr->direct_writes = true;
+        break;
+
+      case SAL_OPT_EVICT_SLOW:
+        params_ptr->evict_slow_period = parse_num_z(optarg, 0);
+        break;
+
+      case SAL_OPT_MAX_CONNECTIONS:
+        params_ptr->max_connections = parse_num_z(optarg, 0);
+        break;
+
+      case SAL_OPT_ADAPTIVE_CHUNKS:
+        params_ptr->adaptive_chunks = parse_num_z(optarg, 0);
+        break;
+
+      case SAL_OPT_HANDOFF:
+        params_ptr->handoff_size = parse_num_z(optarg, 1);
+        params_ptr->multi_interface = true;
+        break;
+
+      case SAL_OPT_HANDOFF_TIME:
+        params_ptr->handoff_time = parse_num_z(optarg, 0);
+        params_ptr->multi_interface = true;
+        break;
+
+      case SAL_OPT_MULTIPLEX:
+        params_ptr->multiplex = parse_num_z(optarg, 0);
+        params_ptr->multi_interface = true;
+        break;
+
+      case SAL_OPT_PREWARM:
+        params_ptr->prewarm = true;
+        break;
+
+      case SAL_OPT_TCP_FASTOPEN:
+        params_ptr->tcp_fastopen = true;
+        break;
+
       default:
         return 1;
         break; /* keep it here in case we change this code in the future */
@@ -18,18 +18,112 @@
 */
 
 #include "events.h"
+#include "multi.h"
 
-static void merge_finished_cb(evutil_socket_t fd, short what, void *arg) {
+/* Merge workers */
+
+/* Claim a finished chunk no other worker is merging, without locking */
+static chunk_s* merge_claim(info_s *info_ptr) {
+  size_t start = 0;
+  size_t chunk_count = prg_index_chunk_count(info_ptr);
+  chunk_s *chunk = NULL;
+
+  while (start < chunk_count && (chunk = first_prg_with_range(info_ptr, PRG_FINISHED, true, start, chunk_count - 1)) ) {
+    if (!__atomic_exchange_n(&chunk->merge_claimed, true, __ATOMIC_ACQ_REL)) {
+      return chunk;
+    }
+    start = chunk->idx + 1;
+  }
+
+  return NULL;
+}
+
+static void* merge_worker(void *void_info_ptr) {
+  info_s *info_ptr = (info_s*)void_info_ptr;
+  merge_workers_s *workers = &info_ptr->merge_workers;
+  size_t seen_wakeups = 0;
+  chunk_s *chunk = NULL;
+
+  saldl_block_sig_pth();
+
+  while (1) {
+    while (info_ptr->session_status != SESSION_INTERRUPTED && (chunk = merge_claim(info_ptr)) ) {
+      info_ptr->merge_finished(chunk, info_ptr);
+    }
+
+    /* Wakeups bumped while claiming are not missed */
+    saldl_pthread_mutex_lock_retry_deadlock(&workers->mutex);
+    while (!workers->done && seen_wakeups == workers->wakeups) {
+      SALDL_ASSERT(!pthread_cond_wait(&workers->cond, &workers->mutex));
+    }
+    seen_wakeups = workers->wakeups;
+    bool done = workers->done;
+    saldl_pthread_mutex_unlock(&workers->mutex);
+
+    if (done) {
+      break;
+    }
+  }
+
+  return info_ptr;
+}
+
+static void merge_workers_wake(info_s *info_ptr, bool done) {
+  merge_workers_s *workers = &info_ptr->merge_workers;
+
+  saldl_pthread_mutex_lock_retry_deadlock(&workers->mutex);
+  workers->wakeups++;
+  workers->done = done;
+  SALDL_ASSERT(!pthread_cond_broadcast(&workers->cond));
+  saldl_pthread_mutex_unlock(&workers->mutex);
+}
+
+static void merge_workers_start(info_s *info_ptr) {
+  merge_workers_s *workers = &info_ptr->merge_workers;
+  size_t count = info_ptr->params->merge_workers;
+
+  SALDL_ASSERT(!pthread_mutex_init(&workers->mutex, NULL));
+  SALDL_ASSERT(!pthread_cond_init(&workers->cond, NULL));
+  workers->pth = saldl_calloc(count, sizeof(pthread_t));
+
+  for (size_t counter = 0; counter < count; counter++) {
+    saldl_pthread_create(&workers->pth[counter], NULL, merge_worker, info_ptr);
+  }
+}
+
+static void merge_workers_join(info_s *info_ptr) {
+  merge_workers_s *workers = &info_ptr->merge_workers;
+
+  merge_workers_wake(info_ptr, true);
+
+  for (size_t counter = 0; counter < info_ptr->params->merge_workers; counter++) {
+    saldl_pthread_join_accept_einval(workers->pth[counter], NULL);
+  }
+
+  SALDL_FREE(workers->pth);
+  SALDL_ASSERT(!pthread_cond_destroy(&workers->cond));
+  SALDL_ASSERT(!pthread_mutex_destroy(&workers->mutex));
+}
+
+/* Merge thread */
+
+static void merge_finished_cb(void *arg) {
   info_s *info_ptr = arg;
   saldl_params *params_ptr = info_ptr->params;
   event_s *ev_merge = &info_ptr->ev_merge;
 
-  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s, with what %d", ++ev_merge->num_of_calls, str_EVENT_FD(fd) , what);
+  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s", ++ev_merge->num_of_calls, str_EVENT_ID(ev_merge->id));
 
   if (!exist_prg(info_ptr, PRG_MERGED, false) || info_ptr->session_status == SESSION_INTERRUPTED) {
     events_deactivate(ev_merge);
   }
 
+  /* Finished chunks are claimed by the workers */
+  if (params_ptr->merge_workers) {
+    merge_workers_wake(info_ptr, false);
+    return;
+  }
+
   bool in_order = params_ptr->to_stdout || params_ptr->merge_in_order;
   chunk_s *first_finished = NULL;
   while ( (first_finished = first_prg(info_ptr, PRG_FINISHED, true)) ) {
@@ -49,6 +143,11 @@ static void merge_finished_cb(evutil_socket_t fd, short what, void *arg) {
     }
   }
 
+  /* Chunks past the old window can be queued now, the multi thread is woken up as it doesn't wait for events */
+  if (params_ptr->reorder_window && set_reorder_limit(info_ptr)) {
+    event_queue(&info_ptr->events, EVENT_BIT(EVENT_QUEUE));
+    multi_wakeup(info_ptr);
+  }
 }
 
 void* merger_thread(void *void_info_ptr) {
@@ -58,10 +157,12 @@ void* merger_thread(void *void_info_ptr) {
   SALDL_ASSERT(info_ptr->ev_merge.event_status == EVENT_NULL);
   info_ptr->ev_merge.event_status = EVENT_THREAD_STARTED;
 
-  /* event loop */
-  /* Use 2s max time-out, the default 0.5s is an overkill */
-  info_ptr->ev_merge.tv =  (struct timeval) { .tv_sec = 2, .tv_usec = 0 };
-  events_init(&info_ptr->ev_merge, merge_finished_cb, info_ptr, EVENT_MERGE_FINISHED);
+  /* event loop, chunks finishing wake it up */
+  events_init(&info_ptr->ev_merge, merge_finished_cb, info_ptr);
+
+  if (info_ptr->params->merge_workers) {
+    merge_workers_start(info_ptr);
+  }
 
   if (exist_prg(info_ptr, PRG_MERGED, false) && info_ptr->session_status != SESSION_INTERRUPTED) {
     debug_msg(FN, "Start ev_merge loop.");
@@ -69,13 +170,45 @@ void* merger_thread(void *void_info_ptr) {
   }
 
   /* Event loop exited */
+  if (info_ptr->params->merge_workers) {
+    merge_workers_join(info_ptr);
+  }
+
   events_deinit(&info_ptr->ev_merge);
 
+  /* ctrl and status loops exit after this one */
+  event_queue(&info_ptr->events, EVENT_BIT(EVENT_CTRL)|EVENT_BIT(EVENT_STATUS));
+
   return info_ptr;
 }
 
+/* Set the end of the reorder window, counting from the first chunk not merged yet.
+ * Returns true if the window moved. */
+bool set_reorder_limit(info_s *info_ptr) {
+  chunk_s *first_unmerged = first_prg(info_ptr, PRG_MERGED, false);
+  off_t limit = first_unmerged ? first_unmerged->range_start + info_ptr->params->reorder_window : OFF_T_MAX;
+
+  if (limit == __atomic_load_n(&info_ptr->reorder_limit, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  __atomic_store_n(&info_ptr->reorder_limit, limit, __ATOMIC_RELEASE);
+  return true;
+}
+
 void set_chunk_merged(chunk_s *chunk) {
   chunk->size_complete = chunk->size;
+
+  /* Appended chunks have no data of their own, the leader is set last so the download isn't done before them */
+  for (size_t counter = 1; counter <= chunk->run_length; counter++) {
+    set_chunk_progress(chunk + counter, PRG_MERGED);
+  }
+
+  /* Before setting progress, so events triggered by it see the parent's final state */
+  if (chunk->parent) {
+    __atomic_fetch_sub(&chunk->parent->pending_sub_chunks, 1, __ATOMIC_RELEASE);
+  }
+
   set_chunk_progress(chunk, PRG_MERGED);
 }
 
@@ -24,6 +24,7 @@
 #endif
 
 void* merger_thread(void *void_info_ptr);
+bool set_reorder_limit(info_s *info_ptr);
 void set_chunk_merged(chunk_s *chunk);
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
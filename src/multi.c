@@ -0,0 +1,549 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "events.h"
+#include "queue.h"
+#include "multi.h"
+#include "aimd.h"
+#include "prewarm.h"
+#include "utime.h"
+
+/* Max time (in ms) to wait for activity before checking pending retries
+ * and the session status again. */
+#define MULTI_MAX_WAIT 1000
+
+/* Max time (in ms) to wait for warm-up requests before checking if the
+ * multi thread is taking over, if curl_multi_wakeup() is not available. */
+#define MULTI_PREWARM_WAIT 100
+
+/* Min time (in s) between updates of stream utilization, with --multiplex */
+#define MULTI_MUX_INTERVAL 1.0
+
+void multi_init(info_s *info_ptr) {
+  SALDL_ASSERT(!info_ptr->multi_handle);
+
+  info_ptr->multi_handle = curl_multi_init();
+  SALDL_ASSERT(info_ptr->multi_handle);
+
+  /* Before warm-up requests are added, they would open a connection each otherwise */
+  if (info_ptr->params->multiplex) {
+    long multiplex = (long)info_ptr->params->multiplex;
+
+    /* Transfers are streams over at most this many HTTP/2 connections */
+    curl_multi_setopt(info_ptr->multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(info_ptr->multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS, multiplex);
+    curl_multi_setopt(info_ptr->multi_handle, CURLMOPT_MAXCONNECTS, multiplex);
+  }
+}
+
+static void multi_wait(CURLM *multi, long timeout_ms) {
+  CURLMcode ret;
+#if CURL_AT_LEAST_VERSION(7, 66, 0)
+  ret = curl_multi_poll(multi, NULL, 0, (int)timeout_ms, NULL);
+#else
+  int numfds = 0;
+  ret = curl_multi_wait(multi, NULL, 0, (int)timeout_ms, &numfds);
+
+  /* curl_multi_wait() returns right away if there is nothing to wait for */
+  if (!ret && !numfds) {
+    usleep(100000);
+  }
+#endif
+
+  if (ret) {
+    fatal(FN, "Waiting for transfers failed: %s", curl_multi_strerror(ret));
+  }
+}
+
+/* Return early from multi_wait(), e.g. if chunks can be queued */
+void multi_wakeup(info_s *info_ptr) {
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+  if (info_ptr->multi_handle) {
+    curl_multi_wakeup(info_ptr->multi_handle);
+  }
+#else
+  (void)info_ptr;
+#endif
+}
+
+static size_t multi_probe_write_function(void *ptr, size_t size, size_t nmemb, void *data) {
+  (void)ptr;
+  (void)size;
+  (void)nmemb;
+
+  /* libcurl keeps the data, and passes it again when the transfer is unpaused */
+  *(bool*)data = true;
+  return CURL_WRITEFUNC_PAUSE;
+}
+
+bool multi_probe(info_s *info_ptr, thread_s *tmp) {
+  CURLM *multi = info_ptr->multi_handle;
+  CURLMcode ret;
+  bool paused = false;
+
+  SALDL_ASSERT(multi);
+  SALDL_ASSERT(tmp->ehandle);
+
+  curl_easy_setopt(tmp->ehandle, CURLOPT_WRITEFUNCTION, multi_probe_write_function);
+  curl_easy_setopt(tmp->ehandle, CURLOPT_WRITEDATA, &paused);
+
+  if ( (ret = curl_multi_add_handle(multi, tmp->ehandle)) ) {
+    fatal(FN, "Adding probe transfer failed: %s", curl_multi_strerror(ret));
+  }
+
+  while (!paused) {
+    int running = 0;
+    int msgs_left = 0;
+    CURLMsg *msg = NULL;
+
+    if ( (ret = curl_multi_perform(multi, &running)) ) {
+      fatal(FN, "Performing probe transfer failed: %s", curl_multi_strerror(ret));
+    }
+
+    while ( (msg = curl_multi_info_read(multi, &msgs_left)) ) {
+      if (msg->msg == CURLMSG_DONE) {
+        /* Warm-up requests are driven with the probe transfer */
+        if (prewarm_multi_done(info_ptr, msg->easy_handle)) {
+          continue;
+        }
+
+        debug_msg(FN, "Probe transfer ended before getting any data (%d: %s).", msg->data.result, tmp->err_buf);
+        curl_multi_remove_handle(multi, tmp->ehandle);
+        return false;
+      }
+    }
+
+    if (!paused) {
+      multi_wait(multi, MULTI_MAX_WAIT);
+    }
+  }
+
+  /* Not called again until a connection takes the transfer over */
+  curl_easy_setopt(tmp->ehandle, CURLOPT_WRITEDATA, NULL);
+  return true;
+}
+
+bool multi_adopt_probe(info_s *info_ptr, thread_s *thread) {
+  thread_s *probe = &info_ptr->probe;
+
+  SALDL_ASSERT(thread->chunk);
+
+  /* The probe transfer can only be used for the first chunk, and only if nothing of it was downloaded */
+  if (!probe->ehandle || thread->chunk->range_start || thread->chunk->size_complete) {
+    return false;
+  }
+
+  debug_msg(FN, "Chunk %"SAL_ZU" continues the probe transfer.", thread->chunk->idx);
+
+  thread->ehandle = probe->ehandle;
+  thread->header_list = probe->header_list;
+  thread->proxy_header_list = probe->proxy_header_list;
+  thread->open_ended = true;
+
+  curl_easy_setopt(thread->ehandle, CURLOPT_ERRORBUFFER, thread->err_buf);
+  curl_easy_setopt(thread->ehandle, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(thread->ehandle, CURLOPT_HEADERDATA, NULL);
+
+  *probe = DEF_THREAD_S;
+  return true;
+}
+
+void multi_discard_probe(info_s *info_ptr) {
+  thread_s *probe = &info_ptr->probe;
+
+  if (!probe->ehandle) {
+    return;
+  }
+
+  debug_msg(FN, "Probe transfer was not taken over, discarding it.");
+
+  curl_multi_remove_handle(info_ptr->multi_handle, probe->ehandle);
+  curl_easy_cleanup(probe->ehandle);
+  curl_slist_free_all(probe->header_list);
+  curl_slist_free_all(probe->proxy_header_list);
+
+  *probe = DEF_THREAD_S;
+}
+
+/* --prewarm: drive warm-up requests until they are all done, or the multi thread takes over */
+void multi_prewarm(info_s *info_ptr) {
+  prewarm_s *prewarm = &info_ptr->prewarm;
+  CURLM *multi = info_ptr->multi_handle;
+  CURLMcode ret;
+
+  SALDL_ASSERT(multi);
+
+  while (prewarm->running && !__atomic_load_n(&prewarm->stop, __ATOMIC_ACQUIRE)) {
+    int running = 0;
+    int msgs_left = 0;
+    CURLMsg *msg = NULL;
+
+    if ( (ret = curl_multi_perform(multi, &running)) ) {
+      fatal(FN, "Performing warm-up requests failed: %s", curl_multi_strerror(ret));
+    }
+
+    while ( (msg = curl_multi_info_read(multi, &msgs_left)) ) {
+      if (msg->msg == CURLMSG_DONE) {
+        /* The probe transfer is not on the multi handle while this runs */
+        bool warm_up = prewarm_multi_done(info_ptr, msg->easy_handle);
+        SALDL_ASSERT(warm_up);
+      }
+    }
+
+    if (prewarm->running) {
+      multi_wait(multi, MULTI_PREWARM_WAIT);
+    }
+  }
+}
+
+void multi_add_thread(info_s *info_ptr, thread_s *thread) {
+  CURLMcode ret;
+  CURLcode pause_ret;
+
+  SALDL_ASSERT(info_ptr->multi_handle);
+  SALDL_ASSERT(thread->ehandle);
+  SALDL_ASSERT(thread->chunk);
+
+  /* Used to get the thread back when the transfer is done */
+  curl_easy_setopt(thread->ehandle, CURLOPT_PRIVATE, thread);
+
+  set_chunk_progress(thread->chunk, PRG_STARTED);
+
+  if (thread->open_ended) {
+    /* Already added as the probe transfer. It was requested up to the end of
+     * the file, which is handled like a chunk shrunk by work stealing. */
+    if (info_ptr->file_size) {
+      thread->chunk->curr_range_end = info_ptr->file_size - 1;
+    }
+
+    if ( (pause_ret = curl_easy_pause(thread->ehandle, CURLPAUSE_CONT)) ) {
+      fatal(FN, "Resuming probe transfer for chunk %"SAL_ZU" failed: %s", thread->chunk->idx, curl_easy_strerror(pause_ret));
+    }
+    return;
+  }
+
+  if ( (ret = curl_multi_add_handle(info_ptr->multi_handle, thread->ehandle)) ) {
+    fatal(FN, "Adding transfer of chunk %"SAL_ZU" failed: %s", thread->chunk->idx, curl_multi_strerror(ret));
+  }
+}
+
+static void multi_readd_thread(info_s *info_ptr, thread_s *thread) {
+  CURLMcode ret;
+
+  if ( (ret = curl_multi_add_handle(info_ptr->multi_handle, thread->ehandle)) ) {
+    fatal(FN, "Re-adding transfer of chunk %"SAL_ZU" failed: %s", thread->chunk->idx, curl_multi_strerror(ret));
+  }
+}
+
+static void multi_transfer_done(info_s *info_ptr, CURL *handle, CURLcode ret) {
+  thread_s *thread = NULL;
+
+  /* Warm-up requests still running when chunk transfers started */
+  if (prewarm_multi_done(info_ptr, handle)) {
+    return;
+  }
+
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&thread);
+  SALDL_ASSERT(thread);
+  SALDL_ASSERT(thread->ehandle == handle);
+
+  curl_multi_remove_handle(info_ptr->multi_handle, handle);
+
+  switch (saldl_perform_check(thread, ret)) {
+    case PERFORM_DONE:
+      hedge_settle(thread);
+      set_chunk_progress(thread->chunk, PRG_FINISHED);
+      break;
+    case PERFORM_RETRY:
+      /* Retried in multi_check_retries() after the delay passes */
+      thread->retry_time = saldl_utime() + (double)thread->delay;
+      break;
+    case PERFORM_RESTART:
+      multi_readd_thread(info_ptr, thread);
+      break;
+    case PERFORM_RECONNECT:
+      saldl_perform_reconnect(thread);
+      multi_readd_thread(info_ptr, thread);
+      break;
+  }
+}
+
+/* Re-add transfers whose retry delay passed.
+ * Returns the time (in ms) until the next pending retry, or -1 if none. */
+static long multi_check_retries(info_s *info_ptr) {
+  long next_retry = -1;
+  double now = saldl_utime();
+
+  for (size_t counter = 0; counter < info_ptr->connections * info_ptr->lanes; counter++) {
+    thread_s *thread = connection_lane(info_ptr, counter % info_ptr->connections, counter / info_ptr->connections);
+
+    if (!thread->retry_time) {
+      continue;
+    }
+
+    if (thread->retry_time <= now) {
+      thread->retry_time = 0;
+      saldl_perform_retry(thread);
+      multi_readd_thread(info_ptr, thread);
+    }
+    else {
+      long rem = (long)((thread->retry_time - now) * 1000) + 1;
+      if (next_retry < 0 || rem < next_retry) {
+        next_retry = rem;
+      }
+    }
+  }
+
+  return next_retry;
+}
+
+/* --handoff: check if the transfer of a lane is close enough to its end for
+ * the other lane of the connection to issue the next request */
+static bool multi_handoff_due(info_s *info_ptr, thread_s *thread) {
+  saldl_params *params_ptr = info_ptr->params;
+  chunk_s *chunk = thread->chunk;
+  curl_off_t speed = 0;
+
+  /* Not receiving data, or waiting to be retried */
+  if (chunk->progress != PRG_STARTED || thread->retry_time) {
+    return false;
+  }
+
+  size_t rem = chunk->size - saldl_min(chunk->size_complete, chunk->size);
+
+  if (rem <= params_ptr->handoff_size) {
+    return true;
+  }
+
+  if (params_ptr->handoff_time) {
+    curl_easy_getinfo(thread->ehandle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    return speed > 0 && (double)rem * 1000 / (double)speed <= (double)params_ptr->handoff_time;
+  }
+
+  return false;
+}
+
+/* Queue the next chunk of a connection if it's idle, or if its transfer is
+ * about to finish and it has an idle lane. Returns true if it's still busy. */
+static bool multi_queue_connection(info_s *info_ptr, size_t counter, bool queue) {
+  thread_s *busy = NULL;
+  thread_s *idle = NULL;
+
+  for (size_t lane = 0; lane < info_ptr->lanes; lane++) {
+    thread_s *thread = connection_lane(info_ptr, counter, lane);
+
+    /* The second lane has no chunk before its first handoff */
+    if (thread->chunk && thread->chunk->progress < PRG_FINISHED) {
+      busy = thread;
+    }
+    else if (!idle) {
+      idle = thread;
+    }
+  }
+
+  /* Connections past the AIMD target are left idle */
+  if (!queue || counter >= info_ptr->aimd.target || !idle) {
+    return busy != NULL;
+  }
+
+  if (busy && !multi_handoff_due(info_ptr, busy)) {
+    return true;
+  }
+
+  if (queue_idle(info_ptr, (size_t)(idle - info_ptr->threads))) {
+    if (busy) {
+      debug_msg(FN, "Chunk %"SAL_ZU" requested while chunk %"SAL_ZU" is finishing.", idle->chunk->idx, busy->chunk->idx);
+    }
+    return true;
+  }
+
+  return busy != NULL;
+}
+
+void multi_mux_init(info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+  mux_s *mux = &info_ptr->mux;
+
+  SALDL_ASSERT(params_ptr->multiplex);
+
+  mux->streams = saldl_calloc(params_ptr->multiplex, sizeof(size_t));
+  mux->ports = saldl_calloc(params_ptr->multiplex, sizeof(long));
+
+  /* Spread transfers evenly over the connections */
+  mux->max_streams = (info_ptr->thread_count + params_ptr->multiplex - 1) / params_ptr->multiplex;
+}
+
+void multi_mux_free(info_s *info_ptr) {
+  SALDL_FREE(info_ptr->mux.streams);
+  SALDL_FREE(info_ptr->mux.ports);
+}
+
+/* --multiplex: count the streams of each connection, transfers are told apart
+ * by the local port of the connection they use, which is 0 until they get one */
+static void multi_mux_update(info_s *info_ptr) {
+  mux_s *mux = &info_ptr->mux;
+  size_t multiplex = info_ptr->params->multiplex;
+  size_t connections = 0;
+  size_t pending = 0;
+  double now = saldl_utime();
+
+  if (now - mux->prev_time < MULTI_MUX_INTERVAL) {
+    return;
+  }
+  mux->prev_time = now;
+
+  for (size_t idx = 0; idx < multiplex; idx++) {
+    __atomic_store_n(&mux->streams[idx], 0, __ATOMIC_RELAXED);
+  }
+
+  for (size_t counter = 0; counter < info_ptr->connections * info_ptr->lanes; counter++) {
+    thread_s *thread = connection_lane(info_ptr, counter % info_ptr->connections, counter / info_ptr->connections);
+    long port = 0;
+    long http_version = 0;
+    size_t idx = 0;
+
+    if (!thread->ehandle || !thread->chunk || thread->chunk->progress != PRG_STARTED || thread->retry_time) {
+      continue;
+    }
+
+    curl_easy_getinfo(thread->ehandle, CURLINFO_LOCAL_PORT, &port);
+    if (!port) {
+      pending++;
+      continue;
+    }
+
+    while (idx < connections && mux->ports[idx] != port) {
+      idx++;
+    }
+
+    if (idx == connections) {
+      /* e.g. a mirror, which gets its own connections */
+      if (connections == multiplex) {
+        continue;
+      }
+      mux->ports[connections++] = port;
+    }
+
+    __atomic_add_fetch(&mux->streams[idx], 1, __ATOMIC_RELAXED);
+
+    curl_easy_getinfo(thread->ehandle, CURLINFO_HTTP_VERSION, &http_version);
+    if (!mux->warned && (http_version == CURL_HTTP_VERSION_1_0 || http_version == CURL_HTTP_VERSION_1_1)) {
+      warn_msg(FN, "HTTP/2 was not negotiated, only %"SAL_ZU" transfer(s) can run at a time.", multiplex);
+      mux->warned = true;
+    }
+  }
+
+  __atomic_store_n(&mux->connections, connections, __ATOMIC_RELAXED);
+  __atomic_store_n(&mux->pending, pending, __ATOMIC_RELAXED);
+}
+
+/* Queue next chunks for idle connections, returns true if all connections are idle */
+static bool multi_queue_idle(info_s *info_ptr) {
+  bool all_idle = true;
+  bool queue = info_ptr->session_status < SESSION_QUEUE_INTERRUPTED;
+
+  for (size_t counter = 0; counter < info_ptr->connections; counter++) {
+    if (multi_queue_connection(info_ptr, counter, queue)) {
+      all_idle = false;
+    }
+  }
+
+  /* After re-queuing, so that connections between chunks are counted as busy */
+  if (queue && info_ptr->params->max_connections) {
+    aimd_update(info_ptr);
+  }
+
+  if (queue && queue_new_connections(info_ptr)) {
+    all_idle = false;
+  }
+
+  /* Not-started chunks could be waiting for the reorder window to move */
+  return all_idle && (info_ptr->session_status >= SESSION_QUEUE_INTERRUPTED || !exist_prg(info_ptr, PRG_NOT_STARTED, true));
+}
+
+void* multi_thread(void *void_info_ptr) {
+  info_s *info_ptr = (info_s*)void_info_ptr;
+  CURLM *multi = info_ptr->multi_handle;
+
+  SALDL_ASSERT(multi);
+
+  if (info_ptr->params->multiplex) {
+    /* The connection limits are set in multi_init(), the number of transfers is only known now */
+#if CURL_AT_LEAST_VERSION(7, 67, 0)
+    /* Otherwise, all streams could end up on the first connection */
+    curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)info_ptr->mux.max_streams);
+#endif
+  }
+  else {
+    /* Multiplexing could have been disabled after multi_init() */
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 0L);
+
+    /* Keep enough connections alive for all chunk transfers to reuse them */
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)info_ptr->thread_count);
+  }
+
+  /* Transfers run in this thread, signals are handled elsewhere */
+  saldl_block_sig_pth();
+
+#ifdef HAVE_SIGACTION
+  /* Same as in saldl_perform(), but once for all transfers */
+  struct sigaction sa_orig;
+  ignore_sig(SIGPIPE, &sa_orig);
+#endif
+
+  while (1) {
+    int running = 0;
+    int msgs_left = 0;
+    CURLMsg *msg = NULL;
+    CURLMcode ret;
+
+    if ( (ret = curl_multi_perform(multi, &running)) ) {
+      fatal(FN, "Performing transfers failed: %s", curl_multi_strerror(ret));
+    }
+
+    while ( (msg = curl_multi_info_read(multi, &msgs_left)) ) {
+      if (msg->msg == CURLMSG_DONE) {
+        /* msg is invalid after removing the handle, so we pass what we need */
+        multi_transfer_done(info_ptr, msg->easy_handle, msg->data.result);
+      }
+    }
+
+    long next_retry = multi_check_retries(info_ptr);
+
+    if (info_ptr->params->multiplex) {
+      multi_mux_update(info_ptr);
+    }
+
+    if (multi_queue_idle(info_ptr)) {
+      debug_msg(FN, "All transfers done.");
+      break;
+    }
+
+    multi_wait(multi, next_retry >= 0 && next_retry < MULTI_MAX_WAIT ? next_retry : MULTI_MAX_WAIT);
+  }
+
+#ifdef HAVE_SIGACTION
+  restore_sig_handler(SIGPIPE, &sa_orig);
+#endif
+
+  return info_ptr;
+}
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
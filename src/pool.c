@@ -0,0 +1,166 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "pool.h"
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* Chunk buffers are recycled between chunks in memory buffers mode.
+ * They are not zeroed, as they are always filled before being merged. */
+
+static char* mem_pool_alloc(mem_pool_s *pool) {
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+  if (pool->buf_size >= SALDL_MEM_POOL_MMAP_MIN_SIZE) {
+    void *buf = mmap(NULL, pool->buf_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+    if (buf == MAP_FAILED) {
+      fatal(FN, "mmap()ing a chunk buffer of size %"SAL_ZU" failed: %s", pool->buf_size, strerror(errno));
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Not fatal, huge pages only save page faults */
+    if (madvise(buf, pool->buf_size, MADV_HUGEPAGE)) {
+      debug_msg(FN, "madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+    }
+#endif
+
+    return buf;
+  }
+#endif
+
+  return saldl_malloc(pool->buf_size);
+}
+
+static void mem_pool_release(mem_pool_s *pool, char *buf) {
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+  if (pool->buf_size >= SALDL_MEM_POOL_MMAP_MIN_SIZE) {
+    if (munmap(buf, pool->buf_size)) {
+      warn_msg(FN, "munmap()ing a chunk buffer failed: %s", strerror(errno));
+    }
+    return;
+  }
+#else
+  (void)pool;
+#endif
+
+  free(buf);
+}
+
+void mem_pool_init(info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+  mem_pool_s *pool = &info_ptr->mem_pool;
+
+  SALDL_ASSERT(params_ptr->chunk_size);
+  SALDL_ASSERT(!pthread_mutex_init(&pool->mutex, NULL));
+
+  /* Sub-chunks and the last chunk are smaller */
+  pool->buf_size = params_ptr->chunk_size;
+
+  if (params_ptr->mem_bufs_limit) {
+    pool->max_bufs = (size_t)(params_ptr->mem_bufs_limit / (off_t)pool->buf_size);
+    SALDL_ASSERT(pool->max_bufs >= params_ptr->num_connections);
+    pool->free_capacity = pool->max_bufs;
+  }
+  else {
+    /* A buffer per thread, plus finished chunks waiting to be merged */
+    pool->free_capacity = info_ptr->thread_count * (1 + SALDL_MEM_POOL_SPARE_PER_CONNECTION);
+  }
+
+  pool->free_bufs = saldl_calloc(pool->free_capacity, sizeof(char*));
+}
+
+/* Check if a buffer can be taken without exceeding the memory buffers limit */
+bool mem_pool_available(mem_pool_s *pool) {
+  bool available;
+
+  saldl_pthread_mutex_lock_retry_deadlock(&pool->mutex);
+  available = !pool->max_bufs || pool->free_count || pool->allocated < pool->max_bufs;
+  saldl_pthread_mutex_unlock(&pool->mutex);
+
+  return available;
+}
+
+char* mem_pool_get(mem_pool_s *pool) {
+  char *buf = NULL;
+
+  saldl_pthread_mutex_lock_retry_deadlock(&pool->mutex);
+
+  if (pool->free_count) {
+    buf = pool->free_bufs[--pool->free_count];
+  }
+  else {
+    SALDL_ASSERT(!pool->max_bufs || pool->allocated < pool->max_bufs);
+    buf = mem_pool_alloc(pool);
+    pool->allocated++;
+  }
+
+  saldl_pthread_mutex_unlock(&pool->mutex);
+
+  return buf;
+}
+
+void mem_pool_put(mem_pool_s *pool, char *buf) {
+  SALDL_ASSERT(buf);
+
+  saldl_pthread_mutex_lock_retry_deadlock(&pool->mutex);
+
+  if (pool->free_count < pool->free_capacity) {
+    pool->free_bufs[pool->free_count++] = buf;
+  }
+  else {
+    mem_pool_release(pool, buf);
+    pool->allocated--;
+  }
+
+  saldl_pthread_mutex_unlock(&pool->mutex);
+}
+
+/* A lent buffer, e.g. still referenced by a pipe, doesn't count towards the limit until it's returned */
+void mem_pool_lend(mem_pool_s *pool) {
+  saldl_pthread_mutex_lock_retry_deadlock(&pool->mutex);
+  SALDL_ASSERT(pool->allocated);
+  pool->allocated--;
+  saldl_pthread_mutex_unlock(&pool->mutex);
+}
+
+void mem_pool_return(mem_pool_s *pool, char *buf) {
+  saldl_pthread_mutex_lock_retry_deadlock(&pool->mutex);
+  pool->allocated++;
+  saldl_pthread_mutex_unlock(&pool->mutex);
+
+  mem_pool_put(pool, buf);
+}
+
+void mem_pool_free(mem_pool_s *pool) {
+  if (!pool->free_bufs) {
+    return;
+  }
+
+  for (size_t idx = 0; idx < pool->free_count; idx++) {
+    mem_pool_release(pool, pool->free_bufs[idx]);
+  }
+
+  SALDL_FREE(pool->free_bufs);
+  SALDL_ASSERT(!pthread_mutex_destroy(&pool->mutex));
+}
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
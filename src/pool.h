@@ -0,0 +1,34 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SALDL_POOL_H
+#define SALDL_POOL_H
+#else
+#error redefining SALDL_POOL_H
+#endif
+
+void mem_pool_init(info_s *info_ptr);
+bool mem_pool_available(mem_pool_s *pool);
+char* mem_pool_get(mem_pool_s *pool);
+void mem_pool_put(mem_pool_s *pool, char *buf);
+void mem_pool_lend(mem_pool_s *pool);
+void mem_pool_return(mem_pool_s *pool, char *buf);
+void mem_pool_free(mem_pool_s *pool);
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -0,0 +1,232 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transfer.h"
+#include "multi.h"
+#include "prewarm.h"
+
+/* Abort warm-up requests still running when they are freed */
+static int prewarm_progress(void *void_prewarm, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  prewarm_s *prewarm = void_prewarm;
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+
+  return __atomic_load_n(&prewarm->stop, __ATOMIC_ACQUIRE);
+}
+
+static void* prewarm_thread(void *void_info_ptr) {
+  info_s *info_ptr = void_info_ptr;
+  prewarm_s *prewarm = &info_ptr->prewarm;
+  size_t idx = __atomic_fetch_add(&prewarm->started, 1, __ATOMIC_RELAXED);
+  thread_s *thread = &prewarm->threads[idx];
+  CURLcode ret;
+
+  saldl_block_sig_pth();
+
+#ifdef HAVE_SIGACTION
+  /* Same as in saldl_perform() */
+  struct sigaction sa_orig;
+  ignore_sig(SIGPIPE, &sa_orig);
+#endif
+
+  /* The connection is kept in the cache of the handle, and reused by the chunk transfer taking it */
+  ret = curl_easy_perform(thread->ehandle);
+  debug_msg(FN, "Warm-up request %"SAL_ZU" done (%d: %s).", idx, ret, ret ? thread->err_buf : "OK");
+
+#ifdef HAVE_SIGACTION
+  restore_sig_handler(SIGPIPE, &sa_orig);
+#endif
+
+  /* The handle is not touched by this thread after this */
+  __atomic_store_n(&prewarm->done[idx], true, __ATOMIC_RELEASE);
+  return thread;
+}
+
+static void* prewarm_multi_thread(void *void_info_ptr) {
+  saldl_block_sig_pth();
+  multi_prewarm(void_info_ptr);
+  return void_info_ptr;
+}
+
+void prewarm_start(info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+  prewarm_s *prewarm = &info_ptr->prewarm;
+  CURLMcode ret;
+
+  if (!params_ptr->prewarm) {
+    return;
+  }
+
+  /* The number of chunks is not known yet, extra handles are freed at the end */
+  prewarm->count = params_ptr->num_connections ? params_ptr->num_connections : SALDL_DEF_NUM_CONNECTIONS;
+  prewarm->threads = saldl_calloc(prewarm->count, sizeof(thread_s));
+  prewarm->done = saldl_calloc(prewarm->count, sizeof(bool));
+
+  if (!info_ptr->multi_handle) {
+    prewarm->pths = saldl_calloc(prewarm->count, sizeof(pthread_t));
+  }
+
+  debug_msg(FN, "Connecting %"SAL_ZU" handle(s) while remote info is requested.", prewarm->count);
+
+  for (size_t idx = 0; idx < prewarm->count; idx++) {
+    thread_s *thread = &prewarm->threads[idx];
+
+    thread->ehandle = curl_easy_init();
+    set_params(thread, info_ptr, params_ptr->start_url);
+
+    /* Redirects are followed, so the connection is made to the same server the probe ends up at */
+    curl_easy_setopt(thread->ehandle, CURLOPT_NOBODY, 1l);
+    curl_easy_setopt(thread->ehandle, CURLOPT_TIMEOUT, SALDL_PREWARM_TIMEOUT);
+    curl_easy_setopt(thread->ehandle, CURLOPT_XFERINFOFUNCTION, prewarm_progress);
+    curl_easy_setopt(thread->ehandle, CURLOPT_XFERINFODATA, prewarm);
+    curl_easy_setopt(thread->ehandle, CURLOPT_NOPROGRESS, 0l);
+
+    if (info_ptr->multi_handle) {
+      if ( (ret = curl_multi_add_handle(info_ptr->multi_handle, thread->ehandle)) ) {
+        fatal(FN, "Adding warm-up request failed: %s", curl_multi_strerror(ret));
+      }
+      prewarm->running++;
+    }
+  }
+
+  if (info_ptr->multi_handle) {
+    /* The zero-probe transfer drives the multi handle itself */
+    if (!params_ptr->zero_probe) {
+      saldl_pthread_create(&prewarm->multi_pth, NULL, prewarm_multi_thread, info_ptr);
+      prewarm->multi_pth_started = true;
+    }
+  }
+  else {
+    /* Each thread takes the next handle */
+    for (size_t idx = 0; idx < prewarm->count; idx++) {
+      saldl_pthread_create(&prewarm->pths[idx], NULL, prewarm_thread, info_ptr);
+    }
+  }
+}
+
+/* Returns true if handle was a warm-up request */
+bool prewarm_multi_done(info_s *info_ptr, CURL *handle) {
+  prewarm_s *prewarm = &info_ptr->prewarm;
+
+  for (size_t idx = 0; idx < prewarm->count; idx++) {
+    if (prewarm->threads[idx].ehandle == handle && !prewarm->done[idx]) {
+      debug_msg(FN, "Warm-up request %"SAL_ZU" done.", idx);
+      curl_multi_remove_handle(info_ptr->multi_handle, handle);
+      prewarm->done[idx] = true;
+      prewarm->running--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Called before chunk transfers start. Warm-up requests are not waited for,
+ * those still running are left for the multi thread to drive, or to their
+ * own threads. Connections start on new handles if none is ready. */
+void prewarm_finish(info_s *info_ptr) {
+  prewarm_s *prewarm = &info_ptr->prewarm;
+
+  if (!info_ptr->params->prewarm || prewarm->finished) {
+    return;
+  }
+
+  if (prewarm->multi_pth_started) {
+    __atomic_store_n(&prewarm->stop, true, __ATOMIC_RELEASE);
+    multi_wakeup(info_ptr);
+    saldl_pthread_join_accept_einval(prewarm->multi_pth, NULL);
+    __atomic_store_n(&prewarm->stop, false, __ATOMIC_RELEASE);
+  }
+
+  prewarm->finished = true;
+}
+
+bool prewarm_adopt(info_s *info_ptr, thread_s *thread) {
+  prewarm_s *prewarm = &info_ptr->prewarm;
+
+  if (!prewarm->finished) {
+    return false;
+  }
+
+  for (size_t idx = 0; idx < prewarm->count; idx++) {
+    thread_s *warm = &prewarm->threads[idx];
+
+    if (!warm->ehandle || !__atomic_load_n(&prewarm->done[idx], __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    /* Options are set again by set_params() and set_progress_params(), except for those only set here */
+    curl_easy_setopt(warm->ehandle, CURLOPT_NOBODY, 0l);
+    curl_easy_setopt(warm->ehandle, CURLOPT_TIMEOUT, 0l);
+    curl_easy_setopt(warm->ehandle, CURLOPT_NOPROGRESS, 1l);
+
+    thread->ehandle = warm->ehandle;
+    curl_slist_free_all(warm->header_list);
+    curl_slist_free_all(warm->proxy_header_list);
+
+    *warm = DEF_THREAD_S;
+    return true;
+  }
+
+  return false;
+}
+
+void prewarm_free(info_s *info_ptr) {
+  prewarm_s *prewarm = &info_ptr->prewarm;
+
+  if (!prewarm->threads) {
+    return;
+  }
+
+  prewarm_finish(info_ptr);
+
+  /* Abort warm-up requests still running */
+  __atomic_store_n(&prewarm->stop, true, __ATOMIC_RELEASE);
+
+  if (prewarm->pths) {
+    for (size_t idx = 0; idx < prewarm->count; idx++) {
+      saldl_pthread_join_accept_einval(prewarm->pths[idx], NULL);
+    }
+  }
+
+  /* Handles not taken, if the file has fewer chunks than connections */
+  for (size_t idx = 0; idx < prewarm->count; idx++) {
+    thread_s *warm = &prewarm->threads[idx];
+
+    if (!warm->ehandle) {
+      continue;
+    }
+
+    if (info_ptr->multi_handle && !prewarm->done[idx]) {
+      curl_multi_remove_handle(info_ptr->multi_handle, warm->ehandle);
+    }
+
+    curl_slist_free_all(warm->header_list);
+    curl_slist_free_all(warm->proxy_header_list);
+    curl_easy_cleanup(warm->ehandle);
+  }
+
+  SALDL_FREE(prewarm->threads);
+  SALDL_FREE(prewarm->done);
+  SALDL_FREE(prewarm->pths);
+}
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
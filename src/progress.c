@@ -19,61 +19,170 @@
 
 #include "events.h"
 
-bool exist_prg(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match) {
-  chunk_s *chunks = info_ptr->chunks;
+#define PRG_WORD_BITS 64
 
-  /* In our use-cases, we return early if we loop backwards */
-  /* counter+1 to avoid using the underflowed value in the comparison */
-  for (size_t counter = info_ptr->chunk_count - 1; counter+1 > 0 ; counter--) {
+/* Bits of a word outside [first_bit, last_bit] are masked out */
+static uint64_t prg_word_mask(size_t first_bit, size_t last_bit) {
+  uint64_t mask = UINT64_MAX << first_bit;
+  return mask & (UINT64_MAX >> (PRG_WORD_BITS - 1 - last_bit));
+}
 
-    if (match && chunks[counter].progress == prg) {
-      return true;
-    }
+static uint64_t prg_word(prg_index_s *index, enum CHUNK_PROGRESS prg, bool match, size_t word_idx) {
+  uint64_t word = __atomic_load_n(&index->bits[prg][word_idx], __ATOMIC_ACQUIRE);
+  return match ? word : ~word;
+}
 
-    if (!match &&  chunks[counter].progress != prg) {
-      return true;
-    }
+void prg_index_init(info_s *info_ptr) {
+  prg_index_s *index = &info_ptr->prg_index;
+  size_t chunk_count = info_ptr->chunk_count;
+
+  index->chunk_count = chunk_count;
+  index->capacity = chunk_count + info_ptr->max_sub_chunks;
+  index->words = (index->capacity + PRG_WORD_BITS - 1) / PRG_WORD_BITS;
+
+  for (size_t prg = PRG_NOT_STARTED; prg <= PRG_MERGED; prg++) {
+    index->bits[prg] = saldl_calloc(index->words, sizeof(uint64_t));
+    index->count[prg] = 0;
+  }
+  index->changed = saldl_calloc(index->words, sizeof(uint64_t));
 
+  /* All chunks start as not started, slots reserved for sub-chunks are not in any set */
+  for (size_t word_idx = 0; word_idx * PRG_WORD_BITS < chunk_count; word_idx++) {
+    size_t last_bit = saldl_min(chunk_count - word_idx * PRG_WORD_BITS, PRG_WORD_BITS) - 1;
+    index->bits[PRG_NOT_STARTED][word_idx] = prg_word_mask(0, last_bit);
   }
+  index->count[PRG_NOT_STARTED] = chunk_count;
 
-  return false;
+  for (size_t idx = 0; idx < index->capacity; idx++) {
+    SALDL_ASSERT(info_ptr->chunks[idx].progress == PRG_NOT_STARTED);
+    info_ptr->chunks[idx].prg_index = index;
+  }
 }
 
-chunk_s* prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end) {
-  chunk_s *chunks = info_ptr->chunks;
+void prg_index_free(info_s *info_ptr) {
+  prg_index_s *index = &info_ptr->prg_index;
 
-  SALDL_ASSERT(start < info_ptr->chunk_count);
-  SALDL_ASSERT(end < info_ptr->chunk_count);
+  for (size_t prg = PRG_NOT_STARTED; prg <= PRG_MERGED; prg++) {
+    SALDL_FREE(index->bits[prg]);
+  }
+  SALDL_FREE(index->changed);
+}
 
-  bool reverse;
+/* Add a sub-chunk (work stealing) to the index as not started */
+void prg_index_add(prg_index_s *index, chunk_s *chunk) {
+  size_t idx = chunk->idx;
 
-  if (end >= start) {
-    reverse = false;
+  SALDL_ASSERT(idx == index->chunk_count);
+  SALDL_ASSERT(idx < index->capacity);
+  SALDL_ASSERT(chunk->progress == PRG_NOT_STARTED);
+
+  __atomic_fetch_or(&index->bits[PRG_NOT_STARTED][idx / PRG_WORD_BITS], (uint64_t)1 << (idx % PRG_WORD_BITS), __ATOMIC_RELEASE);
+  __atomic_fetch_add(&index->count[PRG_NOT_STARTED], 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&index->chunk_count, idx + 1, __ATOMIC_RELEASE);
+}
+
+size_t prg_index_chunk_count(info_s *info_ptr) {
+  return __atomic_load_n(&info_ptr->prg_index.chunk_count, __ATOMIC_ACQUIRE);
+}
+
+static void prg_index_move(prg_index_s *index, size_t idx, enum CHUNK_PROGRESS from, enum CHUNK_PROGRESS to) {
+  uint64_t bit = (uint64_t)1 << (idx % PRG_WORD_BITS);
+  size_t word_idx = idx / PRG_WORD_BITS;
+
+  SALDL_ASSERT(idx < index->capacity);
+  SALDL_ASSERT(from <= PRG_MERGED && to <= PRG_MERGED);
+
+  /* Add before removing, so a chunk is never missing from all sets */
+  __atomic_fetch_or(&index->bits[to][word_idx], bit, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&index->count[to], 1, __ATOMIC_RELEASE);
+  __atomic_fetch_and(&index->bits[from][word_idx], ~bit, __ATOMIC_RELEASE);
+  __atomic_fetch_sub(&index->count[from], 1, __ATOMIC_RELEASE);
+}
+
+/* Sub-chunks change the layout progress of the chunks they were split from */
+static void prg_index_mark_changed(prg_index_s *index, chunk_s *chunk) {
+  size_t idx = chunk->parent ? chunk->parent->idx : chunk->idx;
+  __atomic_fetch_or(&index->changed[idx / PRG_WORD_BITS], (uint64_t)1 << (idx % PRG_WORD_BITS), __ATOMIC_RELEASE);
+}
+
+/* Get and clear a word of the changed set */
+uint64_t prg_index_take_changed(prg_index_s *index, size_t word_idx) {
+  SALDL_ASSERT(word_idx < index->words);
+  return __atomic_exchange_n(&index->changed[word_idx], 0, __ATOMIC_ACQ_REL);
+}
+
+/* All chunks reached their final progress, merged, or finished in single mode */
+bool prg_index_done(prg_index_s *index) {
+  size_t chunk_count = __atomic_load_n(&index->chunk_count, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&index->count[PRG_MERGED], __ATOMIC_ACQUIRE) == chunk_count) {
+    return true;
   }
-  else {
-    reverse = true;
+
+  return chunk_count == 1 && __atomic_load_n(&index->count[PRG_FINISHED], __ATOMIC_ACQUIRE) == 1;
+}
+
+bool exist_prg(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match) {
+  prg_index_s *index = &info_ptr->prg_index;
+  size_t count = __atomic_load_n(&index->count[prg], __ATOMIC_ACQUIRE);
+
+  SALDL_ASSERT(prg <= PRG_MERGED);
+
+  if (match) {
+    return count;
   }
 
-  size_t index = start;
-  while(true) {
-    if (!reverse && index > end) break;
-    /* Checking against SIZE_MAX in case the decrement caused wrapping */
-    if (reverse && (index < end || index == SIZE_MAX)) break;
+  return count < prg_index_chunk_count(info_ptr);
+}
+
+static chunk_s* prg_with_range_forward(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end) {
+  prg_index_s *index = &info_ptr->prg_index;
 
-    if (match && chunks[index].progress == prg) {
-      return &chunks[index];
-    }
+  for (size_t word_idx = start / PRG_WORD_BITS; word_idx <= end / PRG_WORD_BITS; word_idx++) {
+    size_t first_bit = word_idx == start / PRG_WORD_BITS ? start % PRG_WORD_BITS : 0;
+    size_t last_bit = word_idx == end / PRG_WORD_BITS ? end % PRG_WORD_BITS : PRG_WORD_BITS - 1;
+    uint64_t word = prg_word(index, prg, match, word_idx) & prg_word_mask(first_bit, last_bit);
 
-    if (!match &&  chunks[index].progress != prg) {
-      return &chunks[index];
+    if (word) {
+      return &info_ptr->chunks[word_idx * PRG_WORD_BITS + (size_t)__builtin_ctzll(word)];
     }
+  }
+
+  return NULL;
+}
+
+static chunk_s* prg_with_range_reverse(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end) {
+  prg_index_s *index = &info_ptr->prg_index;
+
+  /* counter+1 to avoid using the underflowed value in the comparison */
+  for (size_t word_idx = start / PRG_WORD_BITS; word_idx+1 > end / PRG_WORD_BITS; word_idx--) {
+    size_t first_bit = word_idx == end / PRG_WORD_BITS ? end % PRG_WORD_BITS : 0;
+    size_t last_bit = word_idx == start / PRG_WORD_BITS ? start % PRG_WORD_BITS : PRG_WORD_BITS - 1;
+    uint64_t word = prg_word(index, prg, match, word_idx) & prg_word_mask(first_bit, last_bit);
 
-    index += reverse ? -1 : 1;
+    if (word) {
+      return &info_ptr->chunks[word_idx * PRG_WORD_BITS + PRG_WORD_BITS - 1 - (size_t)__builtin_clzll(word)];
+    }
   }
 
   return NULL;
 }
 
+chunk_s* prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end) {
+  size_t chunk_count = prg_index_chunk_count(info_ptr);
+
+  SALDL_ASSERT(start < chunk_count);
+  SALDL_ASSERT(end < chunk_count);
+  SALDL_ASSERT(prg <= PRG_MERGED);
+
+  if (end >= start) {
+    return prg_with_range_forward(info_ptr, prg, match, start, end);
+  }
+  else {
+    return prg_with_range_reverse(info_ptr, prg, match, start, end);
+  }
+}
+
 chunk_s* first_prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end) {
   SALDL_ASSERT(end >= start);
   return prg_with_range(info_ptr, prg, match, start, end);
@@ -85,15 +194,58 @@ chunk_s* last_prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool mat
 }
 
 chunk_s* first_prg(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match) {
-  return first_prg_with_range(info_ptr, prg, match, 0, info_ptr->chunk_count-1);
+  return first_prg_with_range(info_ptr, prg, match, 0, prg_index_chunk_count(info_ptr)-1);
+}
+
+/* Progress of a chunk's original range, as saved in ctrl files and shown in status */
+enum CHUNK_PROGRESS chunk_layout_progress(chunk_s *chunk) {
+  /* Chunks appended to another one are downloaded and merged with it */
+  if (chunk->run_leader) {
+    chunk = chunk->run_leader;
+  }
+
+  enum CHUNK_PROGRESS progress = chunk->progress;
+
+  /* Parts of the range split off by work stealing are not merged yet */
+  if (progress > PRG_STARTED && __atomic_load_n(&chunk->pending_sub_chunks, __ATOMIC_ACQUIRE)) {
+    return PRG_STARTED;
+  }
+
+  return progress;
+}
+
+/* Adaptive chunks: extend the range of a chunk that's not queued yet to cover the next one */
+void chunk_run_append(chunk_s *leader, chunk_s *chunk) {
+  SALDL_ASSERT(leader->progress == PRG_NOT_STARTED && !leader->run_leader);
+  SALDL_ASSERT(chunk->progress == PRG_NOT_STARTED);
+  SALDL_ASSERT(chunk->idx == leader->idx + leader->run_length + 1);
+
+  /* Before setting progress, so the ctrl file sees the chunk as appended */
+  chunk->run_leader = leader;
+  leader->run_length++;
+  leader->size += chunk->size;
+  leader->range_end = chunk->range_end;
+
+  /* Merged with the leader, see set_chunk_merged() */
+  set_chunk_progress(chunk, PRG_STARTED);
 }
 
 void set_chunk_progress(chunk_s *chunk, enum CHUNK_PROGRESS progress){
+  enum CHUNK_PROGRESS prev_progress = chunk->progress;
+
+  SALDL_ASSERT(chunk->prg_index);
+
   chunk->progress = progress;
-  event_queue(chunk->ev_trigger, chunk->ev_queue);
-  event_queue(chunk->ev_trigger, chunk->ev_merge);
-  event_queue(chunk->ev_trigger, chunk->ev_ctrl);
-  event_queue(chunk->ev_trigger, chunk->ev_status);
+  if (prev_progress != progress) {
+    prg_index_move(chunk->prg_index, chunk->idx, prev_progress, progress);
+    prg_index_mark_changed(chunk->prg_index, chunk);
+  }
+
+  event_queue(chunk->events, EVENT_PROGRESS_MASK);
+
+  if (progress >= PRG_FINISHED && prg_index_done(chunk->prg_index)) {
+    events_done(chunk->events);
+  }
 }
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -59,16 +59,25 @@ enum CH_CHUNK_PROGRESS {
   CH_PRG_STARTED = '2',
   CH_PRG_FINISHED = '3', // but not merged
   CH_PRG_MERGED = '4',
+  CH_PRG_RUN = '5', // appended to the previous chunk, which has the progress of both
   CH_PRG_UNDEF = '7'
 };
 
 #include "structs.h"
 
+void prg_index_init(info_s *info_ptr);
+void prg_index_free(info_s *info_ptr);
+void prg_index_add(prg_index_s *index, chunk_s *chunk);
+size_t prg_index_chunk_count(info_s *info_ptr);
+uint64_t prg_index_take_changed(prg_index_s *index, size_t word_idx);
+bool prg_index_done(prg_index_s *index);
 bool exist_prg(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match);
 chunk_s* first_prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end);
 chunk_s* last_prg_with_range(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match, size_t start, size_t end);
 chunk_s* first_prg(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match);
 size_t first_prg_idx(info_s *info_ptr, enum CHUNK_PROGRESS prg, bool match);
 void set_chunk_progress(chunk_s *chunk, enum CHUNK_PROGRESS progress);
+enum CHUNK_PROGRESS chunk_layout_progress(chunk_s *chunk);
+void chunk_run_append(chunk_s *leader, chunk_s *chunk);
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -18,6 +18,10 @@
 */
 
 #include "events.h"
+#include "multi.h"
+#include "pool.h"
+#include "aimd.h"
+#include "prewarm.h"
 
 static size_t last_chunk_from_last_size(info_s *info_ptr) {
   size_t rem_last_sz;
@@ -116,20 +120,327 @@ static chunk_s* pick_next(info_s *info_ptr) {
   return chunk;
 }
 
+/* Chunks past the reorder window wait for earlier ones to be merged */
+static bool past_reorder_window(info_s *info_ptr, chunk_s *chunk) {
+  return info_ptr->params->reorder_window &&
+    chunk->range_start >= __atomic_load_n(&info_ptr->reorder_limit, __ATOMIC_ACQUIRE);
+}
+
+/* Adaptive chunks: update the rate and the time to the first byte of a connection from its last transfer */
+static void run_sample(thread_s *thread) {
+  curl_off_t size = 0;
+  double total_time = 0;
+  double start_time = 0;
+  double pre_time = 0;
+
+  curl_easy_getinfo(thread->ehandle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+  curl_easy_getinfo(thread->ehandle, CURLINFO_TOTAL_TIME, &total_time);
+  curl_easy_getinfo(thread->ehandle, CURLINFO_STARTTRANSFER_TIME, &start_time);
+  curl_easy_getinfo(thread->ehandle, CURLINFO_PRETRANSFER_TIME, &pre_time);
+
+  /* Too little data to tell the rate apart from the request's overhead */
+  if (size < SALDL_ADAPTIVE_MIN_SAMPLE || total_time <= start_time) {
+    return;
+  }
+
+  double rate = (double)size / (total_time - start_time);
+  double rtt = start_time > pre_time ? start_time - pre_time : 0;
+
+  if (thread->adaptive_rate) {
+    rate = SALDL_ADAPTIVE_EWMA_WEIGHT * rate + (1 - SALDL_ADAPTIVE_EWMA_WEIGHT) * thread->adaptive_rate;
+    rtt = SALDL_ADAPTIVE_EWMA_WEIGHT * rtt + (1 - SALDL_ADAPTIVE_EWMA_WEIGHT) * thread->adaptive_rtt;
+  }
+
+  thread->adaptive_rate = rate;
+  thread->adaptive_rtt = rtt;
+}
+
+/* Adaptive chunks: append the not-started chunks following the picked one to it,
+ * so that the request takes the requested number of seconds at the connection's
+ * rate, and lasts long enough to make the round trip before it negligible.
+ * Near the end of the file, not-started chunks are shared by all connections. */
+static void run_extend(info_s *info_ptr, size_t thr_idx, chunk_s *chunk, int init) {
+  thread_s *thread = &info_ptr->threads[thr_idx];
+  saldl_params *params_ptr = info_ptr->params;
+
+  /* Connections start with a single chunk, until their rate is measured */
+  if (!init) {
+    run_sample(thread);
+  }
+
+  if (!thread->adaptive_rate) {
+    return;
+  }
+
+  double secs = (double)params_ptr->adaptive_chunks;
+  secs = thread->adaptive_rtt * SALDL_ADAPTIVE_RTTS > secs ? thread->adaptive_rtt * SALDL_ADAPTIVE_RTTS : secs;
+  double target_count = thread->adaptive_rate * secs / (double)params_ptr->chunk_size;
+  size_t connections = saldl_max(info_ptr->connections, 1);
+  size_t not_started = __atomic_load_n(&info_ptr->prg_index.count[PRG_NOT_STARTED], __ATOMIC_ACQUIRE);
+  size_t fair_count = not_started / connections + !!(not_started % connections);
+  size_t count = target_count < (double)fair_count ? (size_t)target_count : fair_count;
+
+  /* Leave room for the sizes of chunks in the run to be added up */
+  count = saldl_min(count, SIZE_MAX / params_ptr->chunk_size);
+
+  for (size_t idx = chunk->idx + 1; chunk->run_length + 1 < count && idx < info_ptr->chunk_count; idx++) {
+    chunk_s *next = &info_ptr->chunks[idx];
+
+    if (next->progress != PRG_NOT_STARTED) {
+      break;
+    }
+
+    /* The whole run must be in the window now, and fit in it once it's the first chunk not merged.
+     * Otherwise, it would be paused at the limit, which only moves after it's merged. */
+    if (params_ptr->reorder_window &&
+        (next->range_end >= __atomic_load_n(&info_ptr->reorder_limit, __ATOMIC_ACQUIRE) ||
+         (off_t)(chunk->size + next->size) > params_ptr->reorder_window)) {
+      break;
+    }
+
+    chunk_run_append(chunk, next);
+  }
+
+  if (chunk->run_length) {
+    debug_msg(FN, "chunk %"SAL_ZU" extended to %"SAL_ZU" chunks (%.2f%s) for connection %"SAL_ZU" (rate: %.2f%s/s, first byte after: %.3fs).",
+        chunk->idx, chunk->run_length + 1, human_size(chunk->size), human_size_suffix(chunk->size), thr_idx,
+        human_size(thread->adaptive_rate), human_size_suffix(thread->adaptive_rate), thread->adaptive_rtt);
+  }
+}
+
+/* A thread of a connection. With --handoff, the second lane of
+ * a connection issues its next request while the first one is finishing,
+ * and the other way around. */
+thread_s* connection_lane(info_s *info_ptr, size_t counter, size_t lane) {
+  SALDL_ASSERT(lane < info_ptr->lanes);
+  return &info_ptr->threads[lane * info_ptr->params->num_connections + counter];
+}
+
+/* Remaining size of a chunk worth splitting, 0 otherwise */
+static off_t steal_rem(chunk_s *chunk) {
+  /* Only steal from chunks that are receiving data, and not racing an endgame copy */
+  if (!chunk || chunk->progress != PRG_STARTED || chunk->curr_pos == chunk->curr_range_start || chunk->hedge_peer) {
+    return 0;
+  }
+
+  return saldl_max_o(chunk->range_end + 1 - chunk->curr_pos, 0);
+}
+
+/* Split the back half of the remaining range of the chunk with the most
+ * data left into a new sub-chunk. Victims are protected by their thread's
+ * range_mutex, as they keep writing while being split. */
+static chunk_s* steal_next(info_s *info_ptr, size_t thr_idx) {
+  thread_s *victim = NULL;
+  off_t victim_rem = 0;
+  chunk_s *sub_chunk = NULL;
+
+  if (info_ptr->sub_chunk_count >= info_ptr->max_sub_chunks) {
+    return NULL;
+  }
+
+  for (size_t counter = 0; counter < info_ptr->connections * info_ptr->lanes; counter++) {
+    thread_s *thread = connection_lane(info_ptr, counter % info_ptr->connections, counter / info_ptr->connections);
+    off_t rem;
+
+    if (thread == &info_ptr->threads[thr_idx]) {
+      continue;
+    }
+
+    saldl_pthread_mutex_lock_retry_deadlock(&thread->range_mutex);
+    rem = steal_rem(thread->chunk);
+    saldl_pthread_mutex_unlock(&thread->range_mutex);
+
+    if (rem > victim_rem) {
+      victim = thread;
+      victim_rem = rem;
+    }
+  }
+
+  if (!victim) {
+    return NULL;
+  }
+
+  saldl_pthread_mutex_lock_retry_deadlock(&victim->range_mutex);
+
+  chunk_s *chunk = victim->chunk;
+  off_t stolen_size = steal_rem(chunk) / 2 >> 12 << 12; /* Round down to 4k boundary */
+
+  if (stolen_size >= SALDL_STEAL_MIN_SIZE) {
+    sub_chunk = &info_ptr->chunks[info_ptr->chunk_count + info_ptr->sub_chunk_count];
+    sub_chunk->parent = chunk->parent ? chunk->parent : chunk;
+    sub_chunk->size = (size_t)stolen_size;
+    sub_chunk->range_start = chunk->range_end - stolen_size + 1;
+    sub_chunk->range_end = chunk->range_end;
+
+    __atomic_fetch_add(&sub_chunk->parent->pending_sub_chunks, 1, __ATOMIC_RELEASE);
+    chunk->range_end -= stolen_size;
+    chunk->size -= (size_t)stolen_size;
+  }
+
+  saldl_pthread_mutex_unlock(&victim->range_mutex);
+
+  if (sub_chunk) {
+    info_ptr->sub_chunk_count++;
+    prg_index_add(&info_ptr->prg_index, sub_chunk);
+    debug_msg(FN, "chunk %"SAL_ZU" split at offset %"SAL_JD", sub-chunk %"SAL_ZU" will be downloaded by connection %"SAL_ZU".",
+        chunk->idx, (intmax_t)sub_chunk->range_start, sub_chunk->idx, thr_idx);
+  }
+
+  return sub_chunk;
+}
+
+/* Remaining size of a chunk worth hedging, 0 otherwise */
+static off_t hedge_rem(chunk_s *chunk) {
+  /* Stalled chunks are hedged too, but a chunk only gets one copy */
+  if (!chunk || chunk->progress != PRG_STARTED || chunk->hedge_peer) {
+    return 0;
+  }
+
+  off_t rem = saldl_max_o(chunk->range_end + 1 - chunk->curr_pos, 0);
+  return rem >= SALDL_HEDGE_MIN_SIZE ? rem : 0;
+}
+
+/* Endgame: download the unfinished part of the chunk with the most data left
+ * again, in a new sub-chunk. Chunks from the other origin are preferred if
+ * there is a mirror. The victim keeps its range until one of the copies
+ * finishes, see hedge_settle(). */
+static chunk_s* hedge_next(info_s *info_ptr, size_t thr_idx) {
+  thread_s *victim = NULL;
+  off_t victim_rem = 0;
+  bool victim_other_origin = false;
+  bool from_mirror = info_ptr->mirror_valid && thr_idx % 2;
+  chunk_s *hedge = NULL;
+
+  if (info_ptr->sub_chunk_count >= info_ptr->max_sub_chunks) {
+    return NULL;
+  }
+
+  for (size_t counter = 0; counter < info_ptr->connections * info_ptr->lanes; counter++) {
+    thread_s *thread = connection_lane(info_ptr, counter % info_ptr->connections, counter / info_ptr->connections);
+    off_t rem;
+    bool other_origin;
+
+    if (thread == &info_ptr->threads[thr_idx]) {
+      continue;
+    }
+
+    saldl_pthread_mutex_lock_retry_deadlock(&thread->range_mutex);
+    rem = hedge_rem(thread->chunk);
+    other_origin = rem && thread->chunk->from_mirror != from_mirror;
+    saldl_pthread_mutex_unlock(&thread->range_mutex);
+
+    if (rem && (other_origin > victim_other_origin || (other_origin == victim_other_origin && rem > victim_rem))) {
+      victim = thread;
+      victim_rem = rem;
+      victim_other_origin = other_origin;
+    }
+  }
+
+  if (!victim) {
+    return NULL;
+  }
+
+  saldl_pthread_mutex_lock_retry_deadlock(&victim->range_mutex);
+
+  chunk_s *chunk = victim->chunk;
+
+  if (hedge_rem(chunk)) {
+    /* Data before the hedge is already written, align its start like the victim's */
+    off_t align = info_ptr->o_direct_align ? (off_t)info_ptr->o_direct_align : 4096;
+    off_t hedge_start = saldl_max_o(chunk->curr_pos / align * align, chunk->range_start);
+
+    hedge = &info_ptr->chunks[info_ptr->chunk_count + info_ptr->sub_chunk_count];
+    hedge->parent = chunk->parent ? chunk->parent : chunk;
+    hedge->size = (size_t)(chunk->range_end - hedge_start + 1);
+    hedge->range_start = hedge_start;
+    hedge->range_end = chunk->range_end;
+
+    __atomic_fetch_add(&hedge->parent->pending_sub_chunks, 1, __ATOMIC_RELEASE);
+    hedge->hedge_peer = chunk;
+    chunk->hedge_peer = hedge;
+  }
+
+  saldl_pthread_mutex_unlock(&victim->range_mutex);
+
+  if (hedge) {
+    info_ptr->sub_chunk_count++;
+    prg_index_add(&info_ptr->prg_index, hedge);
+    debug_msg(FN, "chunk %"SAL_ZU" hedged from offset %"SAL_JD", sub-chunk %"SAL_ZU" will be downloaded by connection %"SAL_ZU".",
+        chunk->idx, (intmax_t)hedge->range_start, hedge->idx, thr_idx);
+  }
+
+  return hedge;
+}
+
+/* Called by both copies of a hedged range when their transfer stops.
+ * The first one to finish wins, and the other one is stopped by chunk_progress().
+ * Both wrote the same data in place, so the victim's range is shrunk to end
+ * where the hedge starts either way, and the hedge's range is complete. */
+void hedge_settle(thread_s *thread) {
+  chunk_s *chunk = thread->chunk;
+  chunk_s *peer = chunk->hedge_peer;
+
+  if (!peer) {
+    return;
+  }
+
+  bool is_hedge = chunk->range_start > peer->range_start;
+  chunk_s *hedge = is_hedge ? chunk : peer;
+
+  if (!__atomic_test_and_set(&hedge->hedge_settled, __ATOMIC_ACQ_REL)) {
+    debug_msg(FN, "%s of chunk %"SAL_ZU" won the endgame race.", is_hedge ? "Hedge" : "Original", is_hedge ? peer->idx : chunk->idx);
+
+    /* A stopped hedge is merged right away, the victim's writes to its range must be complete by then */
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+    if (!is_hedge) {
+      flush_storage_direct(chunk);
+    }
+#endif
+
+    __atomic_store_n(&peer->hedge_lost, true, __ATOMIC_RELEASE);
+  }
+
+  if (!is_hedge) {
+    saldl_pthread_mutex_lock_retry_deadlock(&thread->range_mutex);
+    chunk->range_end = hedge->range_start - 1;
+    chunk->size = (size_t)(hedge->range_start - chunk->range_start);
+    saldl_pthread_mutex_unlock(&thread->range_mutex);
+  }
+
+  chunk->size_complete = chunk->size;
+}
+
+/* Check if idle connections can still get work */
+bool more_to_queue(info_s *info_ptr) {
+  if (exist_prg(info_ptr, PRG_NOT_STARTED, true)) {
+    return true;
+  }
+
+  /* With work stealing or endgame hedging, running chunks can still be split or copied */
+  return (info_ptr->params->work_stealing || info_ptr->params->endgame) &&
+    info_ptr->sub_chunk_count < info_ptr->max_sub_chunks &&
+    (exist_prg(info_ptr, PRG_QUEUED, true) || exist_prg(info_ptr, PRG_STARTED, true));
+}
+
 void prep_next(info_s *info_ptr, thread_s *thread, chunk_s *chunk, int init) {
 
   saldl_params *params_ptr = info_ptr->params;
   file_s *storage_info = &info_ptr->storage_info;
 
   thread->chunk = chunk;
-  info_ptr->prepare_storage(thread->chunk, storage_info);
+  info_ptr->prepare_storage(thread->chunk, storage_info, info_ptr);
+  saldl_perform_reset(thread);
 
   if (params_ptr->single_mode) {
     thread->single = true;
   }
 
-  if (init) {
-    thread->ehandle = curl_easy_init() ;
+  /* The connection starting the first chunk continues the zero-probe transfer if there is one */
+  if (init && !multi_adopt_probe(info_ptr, thread)) {
+    /* A handle connected with --prewarm, or a new one */
+    if (!prewarm_adopt(info_ptr, thread)) {
+      thread->ehandle = curl_easy_init() ;
+    }
 
     if (thread->chunk->from_mirror) {
       set_params(thread, info_ptr, info_ptr->mirror_remote_info.effective_url);
@@ -146,7 +457,11 @@ void prep_next(info_s *info_ptr, thread_s *thread, chunk_s *chunk, int init) {
   }
 
   set_progress_params(thread, info_ptr);
-  set_write_opts(thread->ehandle, thread->chunk->storage, params_ptr, false);
+  set_chunk_write_opts(thread, params_ptr);
+
+  if (thread->slow_evict) {
+    slow_evict_prep(thread, info_ptr);
+  }
 
   /* Don't set ranges for single mode unless we are resuming.
    * To avoid setting range for naive servers reporting 0 size */
@@ -157,10 +472,9 @@ void prep_next(info_s *info_ptr, thread_s *thread, chunk_s *chunk, int init) {
   set_chunk_progress(thread->chunk, PRG_QUEUED);
 }
 
-void queue_next_chunk(info_s *info_ptr, size_t thr_idx, int init) {
+static void queue_chunk(info_s *info_ptr, size_t thr_idx, chunk_s *chunk, int init) {
 
   thread_s *thr = &info_ptr->threads[thr_idx];
-  chunk_s *chunk = pick_next(info_ptr);
 
   if (info_ptr->mirror_valid) {
     chunk->from_mirror = thr_idx % 2;
@@ -169,24 +483,93 @@ void queue_next_chunk(info_s *info_ptr, size_t thr_idx, int init) {
   prep_next(info_ptr, thr, chunk, init);
 
   /* Fetch */
-  saldl_pthread_create(&thr->chunk->thr_id, NULL, thread_func, thr);
+  if (info_ptr->multi_handle) {
+    multi_add_thread(info_ptr, thr);
+  }
+  else {
+    saldl_pthread_create(&thr->chunk->thr_id, NULL, thread_func, thr);
+  }
+}
+
+void queue_next_chunk(info_s *info_ptr, size_t thr_idx, int init) {
+  queue_chunk(info_ptr, thr_idx, pick_next(info_ptr), init);
+}
+
+/* Queue a not-started chunk, or a chunk stolen from a running one, for an idle connection.
+ * Returns true if something was queued. */
+bool queue_idle(info_s *info_ptr, size_t thr_idx) {
+  chunk_s *chunk = NULL;
+  int init = !info_ptr->threads[thr_idx].ehandle; /* a connection started by the AIMD controller */
+
+  /* Wait for a merge to free a chunk buffer, instead of exceeding the memory buffers limit */
+  if (info_ptr->params->mem_bufs_limit && !mem_pool_available(&info_ptr->mem_pool)) {
+    return false;
+  }
+
+  if (exist_prg(info_ptr, PRG_NOT_STARTED, true)) {
+    chunk = pick_next(info_ptr);
+
+    if (past_reorder_window(info_ptr, chunk)) {
+      return false;
+    }
+
+    if (info_ptr->params->adaptive_chunks) {
+      run_extend(info_ptr, thr_idx, chunk, init);
+    }
+
+    queue_chunk(info_ptr, thr_idx, chunk, init);
+    return true;
+  }
+
+  if (info_ptr->params->work_stealing && (chunk = steal_next(info_ptr, thr_idx)) ) {
+    queue_chunk(info_ptr, thr_idx, chunk, init);
+    return true;
+  }
+
+  if (info_ptr->params->endgame && (chunk = hedge_next(info_ptr, thr_idx)) ) {
+    queue_chunk(info_ptr, thr_idx, chunk, init);
+    return true;
+  }
+
+  return false;
 }
 
-static void queue_next_cb(evutil_socket_t fd, short what, void *arg) {
+/* Start connections up to the AIMD target, returns true if any was started */
+bool queue_new_connections(info_s *info_ptr) {
+  bool started = false;
+
+  while (info_ptr->connections < info_ptr->aimd.target && more_to_queue(info_ptr) &&
+      queue_idle(info_ptr, info_ptr->connections)) {
+    info_ptr->connections++;
+    started = true;
+  }
+
+  return started;
+}
+
+static void queue_next_cb(void *arg) {
   info_s *info_ptr = arg;
   event_s *ev_queue = &info_ptr->ev_queue;
 
-  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s, with what %d", ++ev_queue->num_of_calls, str_EVENT_FD(fd) , what);
+  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s", ++ev_queue->num_of_calls, str_EVENT_ID(ev_queue->id));
 
-  if (info_ptr->session_status >= SESSION_QUEUE_INTERRUPTED || !exist_prg(info_ptr, PRG_NOT_STARTED, true) ) {
+  if (info_ptr->session_status >= SESSION_QUEUE_INTERRUPTED || !more_to_queue(info_ptr) ) {
     events_deactivate(ev_queue);
   }
 
-  for (size_t counter = 0; counter < info_ptr->params->num_connections && exist_prg(info_ptr, PRG_NOT_STARTED, true); counter++) {
-    if (info_ptr->threads[counter].chunk->progress >= PRG_FINISHED) {
-      queue_next_chunk(info_ptr, counter, 0);
+  /* Connections past the AIMD target are left idle */
+  for (size_t counter = 0; counter < info_ptr->connections && more_to_queue(info_ptr); counter++) {
+    if (counter < info_ptr->aimd.target && info_ptr->threads[counter].chunk->progress >= PRG_FINISHED) {
+      queue_idle(info_ptr, counter);
     }
   }
+
+  /* After re-queuing, so that connections between chunks are counted as busy */
+  if (info_ptr->params->max_connections) {
+    aimd_update(info_ptr);
+  }
+
+  queue_new_connections(info_ptr);
 }
 
 void* queue_next_thread(void *void_info_ptr) {
@@ -196,10 +579,15 @@ void* queue_next_thread(void *void_info_ptr) {
   SALDL_ASSERT(info_ptr->ev_queue.event_status == EVENT_NULL);
   info_ptr->ev_queue.event_status = EVENT_THREAD_STARTED;
 
-  /* event loop */
-  events_init(&info_ptr->ev_queue, queue_next_cb, info_ptr, EVENT_QUEUE);
+  /* event loop, also woken up periodically to update the AIMD controller */
+  if (info_ptr->params->max_connections) {
+    uint64_t interval_usec = (uint64_t)(SALDL_AIMD_INTERVAL * 1000000);
+    info_ptr->ev_queue.tv.tv_sec = interval_usec / 1000000;
+    info_ptr->ev_queue.tv.tv_usec = interval_usec % 1000000;
+  }
+  events_init(&info_ptr->ev_queue, queue_next_cb, info_ptr);
 
-  if (info_ptr->session_status < SESSION_QUEUE_INTERRUPTED && exist_prg(info_ptr, PRG_NOT_STARTED, true)) {
+  if (info_ptr->session_status < SESSION_QUEUE_INTERRUPTED && more_to_queue(info_ptr)) {
     debug_msg(FN, "Start ev_queue loop.");
     events_activate(&info_ptr->ev_queue);
   }
@@ -26,5 +26,10 @@
 void* queue_next_thread(void *void_info_ptr);
 void prep_next(info_s *info_ptr, thread_s *thread, chunk_s *chunk, int init);
 void queue_next_chunk(info_s *info_ptr, size_t thr_idx, int init);
+bool queue_idle(info_s *info_ptr, size_t thr_idx);
+bool queue_new_connections(info_s *info_ptr);
+bool more_to_queue(info_s *info_ptr);
+thread_s* connection_lane(info_s *info_ptr, size_t counter, size_t lane);
+void hedge_settle(thread_s *thread);
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
@@ -17,12 +17,56 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <dirent.h>
+
 #include "transfer.h"
 #include "ctrl.h"
 
+/* Sub-chunks split by work stealing are not saved in the ctrl file,
+ * their parents get downloaded again. So, remove their tmp files. */
+static void remove_sub_chunk_tmp_files(info_s *info_ptr) {
+  DIR *tmp_dir = opendir(info_ptr->tmp_dirname);
+  struct dirent *entry;
+
+  if (!tmp_dir) {
+    return;
+  }
+
+  while ( (entry = readdir(tmp_dir)) ) {
+    char *end = NULL;
+    char idx_filename[PATH_MAX];
+    uintmax_t idx = strtoumax(entry->d_name, &end, 10);
+
+    if (end == entry->d_name || *end || idx < info_ptr->chunk_count) {
+      continue;
+    }
+
+    saldl_snprintf(false, idx_filename, PATH_MAX, "%s/%s", info_ptr->tmp_dirname, entry->d_name);
+    debug_msg(FN, "Removing %s, left over from a sub-chunk.", idx_filename);
+
+    if ( remove(idx_filename) ) {
+      fatal(FN, "Removing file %s failed: %s", idx_filename, strerror(errno));
+    }
+  }
+
+  closedir(tmp_dir);
+}
+
+/* Append chunks saved as part of the run of a chunk (adaptive chunks), its tmp file covers all of them */
+static void extra_resume_run(info_s *info_ptr, char *chunks_progress_str, chunk_s *leader) {
+  for (size_t idx = leader->idx + 1; idx < info_ptr->chunk_count && chunks_progress_str[idx] == CH_PRG_RUN; idx++) {
+    chunk_run_append(leader, &info_ptr->chunks[idx]);
+  }
+
+  if (leader->run_length) {
+    debug_msg(FN, "chunk %"SAL_ZU" had %"SAL_ZU" chunk(s) appended to it in a previous run.", leader->idx, leader->run_length);
+  }
+}
+
 static void extra_resume(info_s *info_ptr, char* chunks_progress_str) {
   size_t idx;
   char c;
+  char run_c = CH_PRG_UNDEF;
 
   if ( info_ptr->chunk_count != strlen(chunks_progress_str) ) {
     fatal(FN, "invalid chunks_progress_str length.");
@@ -30,7 +74,23 @@ static void extra_resume(info_s *info_ptr, char* chunks_progress_str) {
 
   for (idx = info_ptr->initial_merged_count; idx <  info_ptr->chunk_count; idx++) {
     c = chunks_progress_str[idx];
-    switch (c) {
+
+    /* Appended chunks have the progress of the run they're in */
+    if (c == CH_PRG_RUN) {
+      if (run_c == CH_PRG_UNDEF) {
+        fatal(FN, "chunk %"SAL_ZU" was appended to no chunk.", idx);
+      }
+
+      /* Already appended to the run again, or downloaded on their own */
+      if (run_c != CH_PRG_MERGED) {
+        continue;
+      }
+    }
+    else {
+      run_c = c;
+    }
+
+    switch (run_c) {
       case CH_PRG_MERGED:
         {
           set_chunk_merged(&info_ptr->chunks[idx]);
@@ -49,6 +109,12 @@ static void extra_resume(info_s *info_ptr, char* chunks_progress_str) {
             break;
           }
 
+          if (info_ptr->params->direct_writes) {
+            /* How much of the chunk reached the part file is unknown */
+            debug_msg(FN, "chunk %"SAL_ZU" was incomplete or unmerged in a previous run, and will be downloaded from scratch with direct writes.", idx);
+            break;
+          }
+
           saldl_snprintf(false, idx_filename, PATH_MAX, "%s/%"SAL_ZU"", info_ptr->tmp_dirname, idx);
           tmpf_size = saldl_fsize_sys(idx_filename);
 
@@ -57,6 +123,9 @@ static void extra_resume(info_s *info_ptr, char* chunks_progress_str) {
             debug_msg(FN, "chunk %"SAL_ZU" will be downloaded from scratch.", idx);
             break;
           }
+
+          extra_resume_run(info_ptr, chunks_progress_str, &info_ptr->chunks[idx]);
+
           if (tmpf_size > info_ptr->chunks[idx].size) {
             fatal(FN, "%s size exceeds chunk_size!! (size=%"SAL_ZU", chunk_size=%"SAL_ZU")", idx_filename, tmpf_size, info_ptr->chunks[idx].size);
           }
@@ -72,12 +141,16 @@ static void extra_resume(info_s *info_ptr, char* chunks_progress_str) {
         }
       default:
         {
-          fatal(FN, "Invalid chunk status '%c'", c);
+          fatal(FN, "Invalid chunk status '%c'", run_c);
           break;
         }
     }
   }
 
+  if (!info_ptr->params->mem_bufs && !info_ptr->params->direct_writes) {
+    remove_sub_chunk_tmp_files(info_ptr);
+  }
+
   info_ptr->extra_resume_set = true;
 }
 
@@ -100,7 +173,8 @@ static off_t resume_was_single(info_s *info_ptr) {
 static off_t resume_was_default(info_s *info_ptr, ctrl_info_s *ctrl) {
   off_t done_size = 0;
 
-  char STR_PRG_MERGED[] = {CH_PRG_MERGED , '\0'};
+  /* Chunks appended to merged ones are merged too */
+  char STR_PRG_MERGED[] = {CH_PRG_MERGED, CH_PRG_RUN, '\0'};
   size_t merged_cont = strspn(ctrl->chunks_progress_str, STR_PRG_MERGED);
 
   SALDL_ASSERT(merged_cont <= ctrl->chunk_count);
@@ -141,6 +215,17 @@ void check_resume(info_s *info_ptr) {
     }
   }
 
+  /* Validators are only saved in binary ctrl files */
+  if (ctrl.etag[0] && info_ptr->remote_info.etag &&
+      strncmp(ctrl.etag, info_ptr->remote_info.etag, SALDL_CTRL_VALIDATOR_SIZE-1)) {
+    fatal(FN, "Server ETag(%s) does not match control ETag(%s), the remote file changed.", info_ptr->remote_info.etag, ctrl.etag);
+  }
+
+  if (ctrl.last_modified[0] && info_ptr->remote_info.last_modified &&
+      strncmp(ctrl.last_modified, info_ptr->remote_info.last_modified, SALDL_CTRL_VALIDATOR_SIZE-1)) {
+    fatal(FN, "Server Last-Modified(%s) does not match control Last-Modified(%s), the remote file changed.", info_ptr->remote_info.last_modified, ctrl.last_modified);
+  }
+
   off_t done_size = 0;
   if ((uintmax_t)ctrl.chunk_size == (uintmax_t)ctrl.file_size) {
     done_size = resume_was_single(info_ptr);
@@ -20,6 +20,12 @@
 #include "saldl.h"
 #include "resume.h"
 #include "queue.h"
+#include "multi.h"
+#include "share.h"
+#include "pool.h"
+#include "uring.h"
+#include "aimd.h"
+#include "prewarm.h"
 #include "exit.h"
 
 info_s *info_global = NULL; /* Referenced in the signal handler */
@@ -38,6 +44,17 @@ static void saldl_free_all(info_s *info_ptr) {
   /* Make valgrind happy */
   SALDL_FREE(info_ptr->threads);
   SALDL_FREE(info_ptr->chunks);
+  SALDL_FREE(info_ptr->storage_info.buf);
+  prg_index_free(info_ptr);
+  spliced_bufs_free(info_ptr);
+  mem_pool_free(&info_ptr->mem_pool);
+  slow_evict_free(info_ptr);
+  multi_mux_free(info_ptr);
+  prewarm_free(info_ptr);
+  events_free(info_ptr);
+#ifdef HAVE_IO_URING
+  uring_free(&info_ptr->uring);
+#endif
 
   saldl_custom_headers_free_all(params_ptr->custom_headers);
   saldl_custom_headers_free_all(params_ptr->proxy_custom_headers);
@@ -45,10 +62,14 @@ static void saldl_free_all(info_s *info_ptr) {
   SALDL_FREE(remote_info->effective_url);
   SALDL_FREE(remote_info->attachment_filename);
   SALDL_FREE(remote_info->content_type);
+  SALDL_FREE(remote_info->etag);
+  SALDL_FREE(remote_info->last_modified);
 
   SALDL_FREE(mirror_remote_info->effective_url);
   SALDL_FREE(mirror_remote_info->attachment_filename);
   SALDL_FREE(mirror_remote_info->content_type);
+  SALDL_FREE(mirror_remote_info->etag);
+  SALDL_FREE(mirror_remote_info->last_modified);
 
   SALDL_FREE(params_ptr->start_url);
   SALDL_FREE(params_ptr->root_dir);
@@ -68,6 +89,7 @@ static void saldl_free_all(info_s *info_ptr) {
 void saldl(saldl_params *params_ptr) {
   /* Definitions */
   info_s info = DEF_INFO_S;
+  sigset_t saved_set;
   info.params = params_ptr;
 
   /* Handle signals */
@@ -84,7 +106,32 @@ void saldl(saldl_params *params_ptr) {
 
   /* Library initializations, should run only once */
   SALDL_ASSERT(!curl_global_init(CURL_GLOBAL_ALL));
-  SALDL_ASSERT(!evthread_use_pthreads());
+
+  /* Before any chunk progress is set */
+  events_setup(&info);
+
+  /* Warm-up requests are HEAD requests, and only useful if chunks are downloaded after getting info */
+  if (params_ptr->prewarm && (params_ptr->no_remote_info || params_ptr->post || params_ptr->raw_post ||
+        params_ptr->get_file_name || params_ptr->get_file_size || params_ptr->get_effective_url || params_ptr->dry_run)) {
+    info_msg(FN, "Pre-warming can't be used with POST, no remote info, dry-run or getting info, disabling.");
+    params_ptr->prewarm = false;
+  }
+
+  /* DNS cache, TLS sessions and cookies are shared by all handles, including the probe one */
+  share_init(&info);
+
+  /* The zero-probe transfer is started on the multi handle, to be continued by a connection later */
+  if (params_ptr->zero_probe) {
+    params_ptr->multi_interface = true;
+  }
+
+  /* All transfers will be driven from one thread if the multi interface is used */
+  if (params_ptr->multi_interface) {
+    multi_init(&info);
+  }
+
+  /* Connect handles for the first chunks while remote info is requested */
+  prewarm_start(&info);
 
   /* get/set initial info */
   main_msg("URL", "%s", params_ptr->start_url);
@@ -93,6 +140,10 @@ void saldl(saldl_params *params_ptr) {
   set_info(&info);
   check_remote_file_size(&info);
 
+  /* The main thread sets chunk progress, which queues events, until the threads are started.
+   * The signal handler queues events too. So, keep signals blocked till then. */
+  saldl_block_sig_pth_save(&saved_set);
+
   /* initialize chunks early for extra_resume() */
   chunks_init(&info);
 
@@ -136,38 +187,67 @@ void saldl(saldl_params *params_ptr) {
 
   /* Check if download was interrupted after all data was merged */
   if (info.already_finished) {
+    saldl_restore_sig_pth(&saved_set);
     goto saldl_all_data_merged;
   }
 
   /* threads, needed by set_modes() */
-  info.threads = saldl_calloc(params_ptr->num_connections, sizeof(thread_s));
+  info.lanes = params_ptr->handoff_size || params_ptr->handoff_time ? 2 : 1;
+  info.thread_count = params_ptr->num_connections * info.lanes;
+  info.threads = saldl_calloc(info.thread_count, sizeof(thread_s));
   set_modes(&info);
 
-  /* 1st iteration */
-  for (size_t counter = 0; counter < params_ptr->num_connections; counter++) {
+  if (params_ptr->multiplex) {
+    multi_mux_init(&info);
+  }
+
+  if (params_ptr->evict_slow_period) {
+    slow_evict_init(&info);
+  }
+
+  /* Handles connected with --prewarm are taken in the 1st iteration, if their request is done */
+  prewarm_finish(&info);
+
+  /* 1st iteration, more connections can be started later with --max-connections */
+  aimd_init(&info);
+  for (size_t counter = 0; counter < info.aimd.target; counter++) {
     queue_next_chunk(&info, counter, 1);
   }
+  info.connections = info.aimd.target;
 
-  /* Create event pthreads */
-  saldl_pthread_create(&info.trigger_events_pth, NULL, events_trigger_thread, &info);
+  if (info.multi_handle) {
+    /* If no connection started with the first chunk */
+    multi_discard_probe(&info);
+    saldl_pthread_create(&info.multi_pth, NULL, multi_thread, &info);
+  }
 
+  /* Create event pthreads */
   if (!params_ptr->read_only && !params_ptr->to_stdout) {
     saldl_pthread_create(&info.sync_ctrl_pth, NULL, sync_ctrl, &info);
   }
 
   if (info.chunk_count != 1) {
     saldl_pthread_create(&info.status_display_pth, NULL, status_display, &info);
-    saldl_pthread_create(&info.queue_next_pth, NULL, queue_next_thread, &info);
+    if (!info.multi_handle) {
+      /* The multi thread queues next chunks itself */
+      saldl_pthread_create(&info.queue_next_pth, NULL, queue_next_thread, &info);
+    }
     saldl_pthread_create(&info.merger_pth, NULL, merger_thread, &info);
   }
 
   /* Now that everything is initialized */
   info.session_status = SESSION_IN_PROGRESS;
+  saldl_restore_sig_pth(&saved_set);
 
-  /* Avoid race in joining event threads if the session was interrupted, or finishing without downloading if single_mode */
-  do {
-    usleep(100000);
-  } while (params_ptr->single_mode ? info.chunks[0].progress != PRG_FINISHED : info.global_progress.complete_size != info.file_size);
+  /* Avoid race in joining event threads if the session was interrupted, or finishing without downloading if single_mode.
+   * Woken up by the last chunk reaching its final progress, exit_routine() takes over on interruption. */
+  if (!prg_index_done(&info.prg_index)) {
+    events_wait_done(&info.events);
+  }
+
+  if (info.multi_handle) {
+    saldl_pthread_join_accept_einval(info.multi_pth, NULL);
+  }
 
   /* Join event pthreads */
   if (!params_ptr->read_only && !params_ptr->to_stdout) {
@@ -180,14 +260,10 @@ void saldl(saldl_params *params_ptr) {
     join_event_pth(&info.ev_merge, &info.merger_pth);
   }
 
-  info.events_queue_done = true;
-  event_queue(&info.ev_trigger, NULL);
-  join_event_pth(&info.ev_trigger ,&info.trigger_events_pth);
-
 saldl_all_data_merged:
 
   /* Remove tmp_dirname */
-  if (!params_ptr->read_only && !params_ptr->mem_bufs && !params_ptr->single_mode) {
+  if (!params_ptr->read_only && !params_ptr->mem_bufs && !params_ptr->direct_writes && !params_ptr->single_mode) {
     if ( rmdir(info.tmp_dirname) ) {
       err_msg(FN, "Failed to delete %s: %s", info.tmp_dirname, strerror(errno) );
     }
@@ -212,6 +288,21 @@ saldl_all_data_merged:
   }
 
   if (!params_ptr->read_only && !params_ptr->to_stdout) {
+#ifdef HAVE_O_DIRECT
+    /* set_modes() is skipped if the download was already finished */
+    if (params_ptr->o_direct && !info.already_finished && close(info.o_direct_fd)) {
+      err_msg(FN, "Failed to close %s opened with O_DIRECT: %s", info.part_filename, strerror(errno));
+    }
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+    /* Don't leave the whole file in the page cache */
+    if (params_ptr->drop_cache) {
+      saldl_fflush(info.part_filename, info.file);
+      saldl_drop_cache(info.part_filename, fileno(info.file));
+    }
+#endif
+
     saldl_fclose(info.part_filename, info.file);
     if (rename(info.part_filename, params_ptr->filename) ) {
       err_msg(FN, "Failed to rename now-complete %s to %s: %s", info.part_filename, params_ptr->filename, strerror(errno));
@@ -43,10 +43,13 @@ typedef struct {
   char* root_dir;
   char* filename;
   size_t chunk_size;
+  size_t write_buf_size;
   size_t last_chunks_first;
   off_t last_size_first;
   bool random_order;
   size_t num_connections;
+  bool multi_interface;
+  bool zero_probe;
   size_t connection_max_rate;
   bool auto_referer;
   char *referer;
@@ -86,10 +89,29 @@ typedef struct {
   int auto_size;
   bool whole_file;
   bool no_mmap;
+  bool no_preallocate;
   bool mem_bufs;
+  off_t mem_bufs_limit;
+  bool direct_writes;
+  bool io_uring;
+  bool o_direct;
+  bool drop_cache;
+  bool mmap_writes;
   bool read_only;
   bool to_stdout;
   bool merge_in_order;
+  off_t reorder_window;
+  size_t merge_workers;
+  bool work_stealing;
+  bool endgame;
+  size_t evict_slow_period;
+  size_t max_connections;
+  size_t adaptive_chunks;
+  size_t handoff_size;
+  size_t handoff_time;
+  size_t multiplex;
+  bool prewarm;
+  bool tcp_fastopen;
   bool allow_ftp_segments;
   size_t timeout_low_speed;
   size_t timeout_low_speed_period;
@@ -0,0 +1,106 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "transfer.h"
+#include "share.h"
+
+/* userptr is the share_locks array of info_s, one lock per shared data type */
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+  pthread_mutex_t *share_locks = userptr;
+  (void)handle;
+  (void)access;
+
+  SALDL_ASSERT(data < CURL_LOCK_DATA_LAST);
+  saldl_pthread_mutex_lock_retry_deadlock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+  pthread_mutex_t *share_locks = userptr;
+  (void)handle;
+
+  SALDL_ASSERT(data < CURL_LOCK_DATA_LAST);
+  saldl_pthread_mutex_unlock(&share_locks[data]);
+}
+
+static bool share_data(CURLSH *share, curl_lock_data data, const char *name) {
+  CURLSHcode ret;
+
+  if ( (ret = curl_share_setopt(share, CURLSHOPT_SHARE, data)) ) {
+    warn_msg(FN, "Sharing %s between connections failed: %s", name, curl_share_strerror(ret));
+    return false;
+  }
+
+  debug_msg(FN, "Sharing %s between connections.", name);
+  return true;
+}
+
+void share_init(info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+
+  SALDL_ASSERT(!info_ptr->share_handle);
+
+  for (size_t idx = 0; idx < CURL_LOCK_DATA_LAST; idx++) {
+    SALDL_ASSERT(!pthread_mutex_init(&info_ptr->share_locks[idx], NULL));
+  }
+
+  info_ptr->share_handle = curl_share_init();
+  SALDL_ASSERT(info_ptr->share_handle);
+
+  curl_share_setopt(info_ptr->share_handle, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(info_ptr->share_handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(info_ptr->share_handle, CURLSHOPT_USERDATA, info_ptr->share_locks);
+
+  share_data(info_ptr->share_handle, CURL_LOCK_DATA_DNS, "DNS cache");
+  share_data(info_ptr->share_handle, CURL_LOCK_DATA_SSL_SESSION, "TLS sessions");
+  info_ptr->shared_cookies = share_data(info_ptr->share_handle, CURL_LOCK_DATA_COOKIE, "cookies");
+
+  /* libcurl does not support using a shared connection cache from
+   * concurrent threads. With the multi interface, all transfers are
+   * driven from one thread, and the probe handle is done before that
+   * thread starts. So, connections can be shared there safely.
+   * That's not the case with --prewarm, where warm-up requests are
+   * performed on the multi handle while the probe handle is used.
+   */
+  if (params_ptr->multi_interface && !params_ptr->prewarm) {
+    share_data(info_ptr->share_handle, CURL_LOCK_DATA_CONNECT, "connections");
+  }
+}
+
+void share_cleanup(info_s *info_ptr) {
+  CURLSHcode ret;
+
+  if (!info_ptr->share_handle) {
+    return;
+  }
+
+  /* All easy handles using the share must have been cleaned up by now */
+  if ( (ret = curl_share_cleanup(info_ptr->share_handle)) ) {
+    warn_msg(FN, "Cleaning up share handle failed: %s", curl_share_strerror(ret));
+    return;
+  }
+
+  info_ptr->share_handle = NULL;
+
+  for (size_t idx = 0; idx < CURL_LOCK_DATA_LAST; idx++) {
+    SALDL_ASSERT(!pthread_mutex_destroy(&info_ptr->share_locks[idx]));
+  }
+}
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
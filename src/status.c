@@ -21,6 +21,7 @@
 #include "utime.h"
 
 #define DEF_STATUS_LINES 8
+#define STATUS_MUX_BUF 256 /* per-connection streams, truncated with many connections */
 
 size_t num_of_lines(info_s *info_ptr, int cols) {
   size_t lines = 0;
@@ -30,6 +31,8 @@ size_t num_of_lines(info_s *info_ptr, int cols) {
   if (cols) {
     lines = DEF_STATUS_LINES;
     lines += !!info_ptr->global_progress.initial_complete_size; // Session
+    lines += !!info_ptr->params->max_connections; // Connections
+    lines += !!info_ptr->params->multiplex; // Streams
     lines += info_ptr->chunk_count / cols + !!(info_ptr->chunk_count % cols); // chunks
   }
 
@@ -78,7 +81,7 @@ static inline void colorset(char *ptr, enum CHUNK_PROGRESS val, bool set_invert,
   }
 }
 
-static void status_update_cb(evutil_socket_t fd, short what, void *arg) {
+static void status_update_cb(void *arg) {
   info_s *info_ptr = arg;
   saldl_params *params_ptr = info_ptr->params;
 
@@ -97,7 +100,7 @@ static void status_update_cb(evutil_socket_t fd, short what, void *arg) {
   int cols = tty_width() >= 0 ? tty_width() : 0;
   status_ptr->lines = num_of_lines(info_ptr, cols);
 
-  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s, with what %d", ++ev_status->num_of_calls, str_EVENT_FD(fd) , what);
+  debug_event_msg(FN, "callback no. %"SAL_JU" for triggered event %s", ++ev_status->num_of_calls, str_EVENT_ID(ev_status->id));
 
 
   /* We check if the merge loop is already de-initialized to not lose status of any merged chunks */
@@ -137,7 +140,7 @@ static void status_update_cb(evutil_socket_t fd, short what, void *arg) {
 
     /* Set progress_status */
     for (size_t counter = 0; counter < info_ptr->chunk_count; counter++) {
-      colorset(chunks_status+(counter*c_char_size), info_ptr->chunks[counter].progress, info_ptr->chunks[counter].from_mirror, 1);
+      colorset(chunks_status+(counter*c_char_size), chunk_layout_progress(&info_ptr->chunks[counter]), info_ptr->chunks[counter].from_mirror, 1);
     }
 
     main_msg("Chunk progress", " ");
@@ -147,6 +150,30 @@ static void status_update_cb(evutil_socket_t fd, short what, void *arg) {
         chsp->started, info_ptr->chunk_count, chsp->empty_started);
     status_msg("Not started", "     \t %"SAL_ZU" / %"SAL_ZU" ((+%"SAL_ZU" queued)",
         chsp->not_started, info_ptr->chunk_count, chsp->queued);
+    if (info_ptr->params->max_connections) {
+      status_msg("Connections", "     \t %"SAL_ZU" / %"SAL_ZU" (target)",
+          __atomic_load_n(&info_ptr->aimd.busy, __ATOMIC_RELAXED),
+          __atomic_load_n(&info_ptr->aimd.target, __ATOMIC_RELAXED));
+    }
+    if (info_ptr->params->multiplex) {
+      mux_s *mux = &info_ptr->mux;
+      size_t connections = __atomic_load_n(&mux->connections, __ATOMIC_RELAXED);
+      size_t streams = 0;
+      char per_conn[STATUS_MUX_BUF] = "";
+      size_t pos = 0;
+
+      for (size_t idx = 0; idx < connections; idx++) {
+        size_t conn_streams = __atomic_load_n(&mux->streams[idx], __ATOMIC_RELAXED);
+        streams += conn_streams;
+        if (pos < sizeof(per_conn)) {
+          int len = snprintf(per_conn + pos, sizeof(per_conn) - pos, " %"SAL_ZU"/%"SAL_ZU, conn_streams, mux->max_streams);
+          pos += len > 0 ? (size_t)len : 0;
+        }
+      }
+
+      status_msg("Streams", "         \t %"SAL_ZU" on %"SAL_ZU" connection(s):%s (+%"SAL_ZU" pending)",
+          streams, connections, per_conn, __atomic_load_n(&mux->pending, __ATOMIC_RELAXED));
+    }
     status_msg("Size complete", "   \t %.2f%s / %.2f%s (%.2f%c)",
         human_size(p->complete_size), human_size_suffix(p->complete_size),
         human_size(info_ptr->file_size), human_size_suffix(info_ptr->file_size),
@@ -188,8 +215,15 @@ void* status_display(void *void_info_ptr) {
   /* initial chunks_status */
   colorset(chunks_status, PRG_NOT_STARTED, false, info_ptr->chunk_count);
 
-  /* event loop */
-  events_init(&info_ptr->ev_status, status_update_cb, info_ptr, EVENT_STATUS);
+  /* event loop, also woken up to refresh rates if no chunk progress is set in time */
+  if (!info_ptr->params->no_status) {
+    double params_refresh = info_ptr->params->status_refresh_interval;
+    double refresh_interval = params_refresh ? params_refresh : SALDL_DEF_STATUS_REFRESH_INTERVAL;
+    uint64_t refresh_usec = (uint64_t)(refresh_interval * 1000000);
+    info_ptr->ev_status.tv.tv_sec = refresh_usec / 1000000;
+    info_ptr->ev_status.tv.tv_usec = refresh_usec % 1000000;
+  }
+  events_init(&info_ptr->ev_status, status_update_cb, info_ptr);
 
   SALDL_ASSERT(info_ptr->global_progress.initialized);
 
@@ -24,8 +24,7 @@
 #endif
 
 #include <pthread.h>
-#include <event2/thread.h>
-#include <event2/event.h>
+#include <sys/time.h>
 
 #include <curl/curl.h>
 
@@ -47,29 +46,50 @@ enum SESSION_STATUS {
   SESSION_INTERRUPTED = 3
 };
 
-/* enum for (fake) negative fd values used in custom events */
-enum EVENT_FD {
-  EVENT_STATUS = -1,
-  EVENT_CTRL = -2,
-  EVENT_MERGE_FINISHED = -3,
-  EVENT_QUEUE = -4,
-  EVENT_TRIGGER = -62,
-  EVENT_NONE = -63
+/* enum for in-kernel merging of tmp files, from the fastest */
+enum MERGE_COPY {
+  MERGE_COPY_NONE = 0,
+  MERGE_COPY_FILE_RANGE = 1,
+  MERGE_COPY_CLONE = 2,
+  MERGE_COPY_SPLICE = 3 /* to the stdout pipe, memory buffers too */
 };
 
-/* event_s */
+/* enum for event loops, also bit positions in the dirty mask */
+enum EVENT_ID {
+  EVENT_STATUS = 0,
+  EVENT_CTRL = 1,
+  EVENT_MERGE_FINISHED = 2,
+  EVENT_QUEUE = 3,
+  EVENT_MAX = 4
+};
+
+#define EVENT_BIT(id) (1u << (id))
+#define EVENT_PROGRESS_MASK (EVENT_BIT(EVENT_STATUS)|EVENT_BIT(EVENT_CTRL)|EVENT_BIT(EVENT_MERGE_FINISHED)|EVENT_BIT(EVENT_QUEUE))
+
+typedef void (*event_cb_fn)(void *cb_data);
+
+/* event_s: an event loop, run by its own thread */
 typedef struct {
-  struct timeval tv;
-  struct event_base *ev_b;
-  struct event *ev;
+  struct timeval tv; /* max time-out between callbacks, zero to only wake up on notifications */
   enum EVENT_STATUS event_status;
-  enum EVENT_FD vFD;
-  pthread_mutex_t ev_mutex;
-  pthread_mutexattr_t ev_mutex_attr;
+  enum EVENT_ID id;
+  pthread_cond_t ev_cond;
+  event_cb_fn cb;
+  void *cb_data;
   uintmax_t num_of_calls;
-  int64_t queued;
+  struct events_s *events;
 } event_s;
 
+/* events_s: notifications for all event loops, coalesced in a dirty mask */
+typedef struct events_s {
+  pthread_mutex_t mutex;
+  unsigned dirty;
+  event_s *loops[EVENT_MAX];
+  pthread_mutex_t done_mutex; /* not taken by exit_routine(), the main thread waits with it */
+  pthread_cond_t done_cond;
+  bool done;
+} events_s;
+
 /* mem_s: for memory buffers */
 typedef struct {
   char *memory;
@@ -77,14 +97,108 @@ typedef struct {
   size_t allocated_size;
 } mem_s;
 
+/* mem_pool_s: chunk buffers recycled in memory buffers mode */
+typedef struct {
+  pthread_mutex_t mutex;
+  size_t buf_size;
+  size_t max_bufs; /* hard cap on allocated buffers, 0 if unlimited */
+  size_t allocated; /* in use or free */
+  size_t free_count;
+  size_t free_capacity;
+  char **free_bufs;
+} mem_pool_s;
+
+/* spliced_bufs_s: chunk buffers vmsplice()d to the stdout pipe, only reused after the pipe's reader consumes them */
+typedef struct {
+  char **bufs;
+  uint64_t *ends; /* bytes spliced up to the end of each buffer */
+  size_t count;
+  size_t capacity;
+  uint64_t total;
+} spliced_bufs_s;
+
 /* file_s: groups file and filename under one ptr, used when tmp files are used as buffers */
 typedef struct {
   char *name;
   FILE *file;
+  char *buf; /* stdio buffer, writes are only flushed when it fills, or before the file is read or sized */
 } file_s;
 
-/* chunk_s: fields needed for each chunk */
+/* direct_s: per-chunk write position when writing to the part file directly */
+typedef struct direct_s {
+  const char *name;
+  int fd;
+  off_t offset;
+  off_t range_end;
+  struct uring_s *uring; /* io_uring mode only */
+  struct uring_buf_s *buf; /* io_uring mode: buffer being filled, submitted when full */
+  size_t in_flight; /* io_uring mode: submitted writes not completed yet */
+  int o_direct_fd; /* O_DIRECT mode: the part file opened with O_DIRECT, -1 if not used */
+  size_t o_direct_align;
+  char *aligned_buf; /* O_DIRECT mode: written when full, or when the chunk is finished */
+  size_t aligned_buf_size;
+  size_t aligned_buf_used;
+  off_t aligned_buf_offset;
+  char *map; /* mmap writes mode: the chunk's window of the part file */
+  size_t map_size;
+  off_t map_offset;
+} direct_s;
+
+/* uring_buf_s: registered buffer, filled with data of one chunk before it's written at its offset */
+typedef struct uring_buf_s {
+  char *data;
+  unsigned idx; /* in registered buffers */
+  size_t size;
+  size_t written; /* short writes are resubmitted */
+  off_t offset;
+  direct_s *owner;
+  struct uring_buf_s *next_free;
+} uring_buf_s;
+
+/* uring_s: io_uring instance, submitting positional writes to the part file in direct writes mode */
+typedef struct uring_s {
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  void *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  void *cqes;
+  bool fixed_bufs; /* buffers were registered */
+  char *bufs_mem;
+  size_t bufs_mem_size;
+  uring_buf_s *bufs;
+  size_t buf_count;
+  size_t buf_size;
+  uring_buf_s *free_bufs;
+  uring_buf_s *filled_bufs; /* waiting to be submitted */
+  int event_fd; /* signaled when buffers are filled, or to stop */
+  int error;
+  bool stop;
+  pthread_t pth; /* the only submitter, requests are cancelled if the thread submitting them exits */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* signaled when writes complete */
+} uring_s;
+
+/* prg_index_s: per-progress bitsets & counters of chunks, kept in sync by set_chunk_progress() */
 typedef struct {
+  size_t chunk_count; /* including sub-chunks added by work stealing */
+  size_t capacity;
+  size_t words;
+  uint64_t *bits[PRG_MERGED+1];
+  size_t count[PRG_MERGED+1];
+  uint64_t *changed; /* chunks whose layout progress changed, consumed by ctrl file updates */
+} prg_index_s;
+
+/* chunk_s: fields needed for each chunk */
+typedef struct chunk_s {
   pthread_t thr_id;
   bool from_mirror;
   size_t idx;
@@ -93,27 +207,75 @@ typedef struct {
   off_t range_start;
   off_t curr_range_start; /* used for strict checking when resuming or resetting */
   off_t range_end;
+  off_t curr_range_end; /* range_end as requested, it can be shrunk mid-transfer by work stealing */
+  off_t curr_pos; /* next offset to be written, only tracked if writes go through the thread */
+  struct chunk_s *parent; /* the chunk a sub-chunk was split from */
+  size_t pending_sub_chunks; /* sub-chunks split from this chunk, and not merged yet */
+  struct chunk_s *hedge_peer; /* endgame: the other copy of the same range */
+  bool hedge_settled; /* set on the hedge sub-chunk by the first copy to finish */
+  bool hedge_lost; /* the peer finished first, stop the transfer */
+  bool merge_claimed; /* taken by a merge worker */
+  size_t run_length; /* adaptive chunks: following chunks appended to this one's range */
+  struct chunk_s *run_leader; /* adaptive chunks: the chunk this one was appended to */
   bool unsafe_range_size_check; // for ftp
   void *storage;
   enum CHUNK_PROGRESS progress;
-  event_s *ev_trigger;
-  event_s *ev_merge;
-  event_s *ev_queue;
-  event_s *ev_ctrl;
-  event_s *ev_status;
+  prg_index_s *prg_index;
+  events_s *events;
 } chunk_s;
 
-/* thread_s: fields needed for each thread/connection */
+/* slow_evict_s: shared by all connections, to evict ones far slower than their peers */
 typedef struct {
+  struct thread_s *threads;
+  size_t count;
+  size_t *sorted; /* scratch space for finding the median */
+  size_t median; /* of connections sampled recently, kept if too few of them are active */
+  size_t active; /* connections sampled recently when the median was found */
+  double median_time;
+  double period; /* evict connections staying below the threshold for this long */
+  pthread_mutex_t mutex; /* guards all fields, and the rates of connections */
+} slow_evict_s;
+
+/* thread_s: fields needed for each thread/connection */
+typedef struct thread_s {
   CURL* ehandle;
   struct curl_slist *header_list;
   struct curl_slist *proxy_header_list;
   char err_buf[CURL_ERROR_SIZE];
   void (*reset_storage)();
+  size_t (*write_function)();
+  pthread_mutex_t range_mutex; /* guards chunk->curr_pos & chunk->range_end with work stealing */
   chunk_s *chunk;
   bool single;
+  size_t retries;
+  short semi_fatal_retries;
+  size_t delay;
+  double retry_time; /* multi interface: when to retry a failed transfer */
+  bool open_ended; /* continuing the zero-probe transfer, requested up to the end of the file */
+  off_t *reorder_limit; /* in-order merging: writes past this offset are paused */
+  bool reorder_paused;
+  slow_evict_s *slow_evict; /* NULL unless --evict-slow */
+  size_t rate; /* EWMA in bytes/s, across the connection's transfers */
+  double rate_stamp; /* when rate was last updated, 0 if never */
+  size_t rate_bytes; /* received since rate_time */
+  curl_off_t rate_dlnow;
+  double rate_time; /* start of the current sample, 0 to restart sampling */
+  double slow_since; /* 0 if not below the eviction threshold */
+  bool evicted;
+  bool throttled; /* got a 429 or 503 response, consumed by the AIMD controller */
+  double adaptive_rate; /* adaptive chunks: EWMA in bytes/s of the connection's transfers, 0 if not measured yet */
+  double adaptive_rtt; /* adaptive chunks: EWMA of the time to the first byte of a request */
 } thread_s;
 
+/* merge_workers_s: threads merging finished chunks in parallel */
+typedef struct {
+  pthread_t *pth;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t wakeups; /* bumped when chunks may have finished */
+  bool done;
+} merge_workers_s;
+
 /* chunks_progress_s: progress of all chunks */
 typedef struct {
   size_t merged;
@@ -151,8 +313,13 @@ typedef struct {
 
 /* control_s: Variables used in .ctrl.sal file updates */
 typedef struct {
-  char *raw_status;
-  long pos;
+  char *raw_status; /* text ctrl files */
+  long pos; /* text ctrl files */
+  unsigned char *map; /* binary ctrl files */
+  size_t map_size;
+  size_t sync_start; /* map range changed since the last flush */
+  size_t sync_end;
+  double last_sync;
 } control_s;
 
 /* headers_s: Variables used in header_function() & headers_info() */
@@ -162,6 +329,8 @@ typedef struct {
   char *content_encoding;
   char *content_type;
   char *content_disposition;
+  char *etag;
+  char *last_modified;
 } headers_s;
 
 /* remote_info_s: Information inferred from checking range support */
@@ -175,8 +344,48 @@ typedef struct {
   char *effective_url;
   char *attachment_filename;
   char *content_type;
+  char *etag;
+  char *last_modified;
 } remote_info_s;
 
+/* aimd_s: AIMD controller of the number of connections given chunks, with --max-connections */
+typedef struct {
+  size_t target; /* connections given new chunks */
+  size_t busy; /* connections with a chunk in progress at the last update */
+  size_t prev_target; /* target during the previous interval */
+  size_t hold; /* updates left before the target can be raised again */
+  bool slow_start_done; /* the target is doubled until the first back-off */
+  off_t prev_complete;
+  double prev_time;
+  double prev_rate;
+  double prev_conn_rate;
+} aimd_s;
+
+/* mux_s: stream utilization of HTTP/2 connections, with --multiplex */
+typedef struct {
+  size_t *streams; /* streams on each connection at the last update */
+  long *ports; /* local port of each connection, to tell them apart */
+  size_t connections; /* connections with at least one stream */
+  size_t max_streams; /* streams allowed per connection */
+  size_t pending; /* transfers waiting for a connection or a stream */
+  double prev_time;
+  bool warned; /* the server did not negotiate HTTP/2 */
+} mux_s;
+
+/* prewarm_s: handles connected while remote info is requested, with --prewarm */
+typedef struct {
+  thread_s *threads; /* taken by connections starting their first chunk, ehandle is NULL once taken */
+  bool *done; /* warm-up request finished, its handle can be taken */
+  pthread_t *pths; /* a thread per warm-up request, without the multi interface */
+  size_t count;
+  size_t started; /* warm-up threads that took their handle */
+  size_t running; /* warm-up requests still on the multi handle */
+  pthread_t multi_pth; /* drives the multi handle while the probe is performed */
+  bool multi_pth_started;
+  bool stop; /* stop driving the multi handle, or abort warm-up requests */
+  bool finished;
+} prewarm_s;
+
 /* info_s: mother of all structs */
 typedef struct {
   saldl_params *params;
@@ -184,14 +393,27 @@ typedef struct {
   file_s storage_info;
   void (*prepare_storage)();
   int (*merge_finished)();
-  pthread_t trigger_events_pth;
   pthread_t queue_next_pth;
   pthread_t merger_pth;
+  merge_workers_s merge_workers;
+  enum MERGE_COPY merge_copy; /* lowered if the filesystem turns out not to support it */
   pthread_t sync_ctrl_pth;
   pthread_t status_display_pth;
+  pthread_t multi_pth;
+  CURLM *multi_handle;
+  CURLSH *share_handle;
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST]; /* one per shared data type, indexed by curl_lock_data */
+  thread_s probe; /* zero-probe transfer, paused until a connection takes it over */
+  bool shared_cookies;
+  bool cookies_loaded;
   size_t rem_size;
   size_t chunk_count;
+  size_t sub_chunk_count;
+  size_t max_sub_chunks;
   size_t initial_merged_count;
+  off_t reorder_limit; /* end of the reorder window, past the first chunk not merged yet */
+  int o_direct_fd;
+  size_t o_direct_align; /* chunk sizes, offsets and buffers are aligned to it with O_DIRECT */
   bool extra_resume_set;
   long redirects_count;
   FILE* file;
@@ -207,13 +429,23 @@ typedef struct {
   remote_info_s mirror_remote_info;
   bool mirror_valid;
   thread_s *threads;
+  size_t lanes; /* threads per connection, 2 with --handoff, see connection_lane() */
+  size_t thread_count; /* num_connections * lanes */
+  size_t connections; /* connections started so far, up to num_connections */
+  aimd_s aimd;
+  mux_s mux;
+  prewarm_s prewarm;
   chunk_s *chunks;
+  prg_index_s prg_index;
+  mem_pool_s mem_pool;
+  spliced_bufs_s spliced_bufs;
+  uring_s uring;
+  slow_evict_s slow_evict;
   progress_s global_progress;
   enum SESSION_STATUS session_status;
   status_s status;
   control_s ctrl;
-  bool events_queue_done;
-  event_s ev_trigger;
+  events_s events;
   event_s ev_merge;
   event_s ev_queue;
   event_s ev_status;
@@ -19,10 +19,18 @@
 
 #include "events.h"
 #include "utime.h"
+#include "share.h"
+#include "multi.h"
+#include "queue.h"
+#include "prewarm.h"
 #include <curl/curl.h>
 
 #define MAX_SEMI_FATAL_RETRIES 5
 
+/* Delays (in seconds) between retries of failed chunk transfers */
+static const size_t max_delay = 32;
+static const size_t init_delay = 1;
+
 #ifndef HAVE_STRCASESTR
 #include "gnulib_strcasestr.h" // gnulib implementation
 #endif
@@ -119,19 +127,22 @@ char* saldl_user_agent() {
 void chunks_init(info_s *info_ptr) {
   size_t chunk_count = info_ptr->chunk_count;
 
-  info_ptr->chunks = saldl_calloc(chunk_count, sizeof(chunk_s));
+  /* Reserve slots for sub-chunks, chunks are referenced by pointers and can't be reallocated */
+  if (info_ptr->params->work_stealing) {
+    info_ptr->max_sub_chunks += info_ptr->params->num_connections * SALDL_STEAL_MAX_SUB_CHUNKS_PER_CONNECTION;
+  }
 
-  for (size_t idx = 0; idx < chunk_count; idx++) {
+  if (info_ptr->params->endgame) {
+    info_ptr->max_sub_chunks += info_ptr->params->num_connections * SALDL_HEDGE_MAX_SUB_CHUNKS_PER_CONNECTION;
+  }
 
-    info_ptr->chunks[idx].idx = idx;
+  info_ptr->chunks = saldl_calloc(chunk_count + info_ptr->max_sub_chunks, sizeof(chunk_s));
 
+  for (size_t idx = 0; idx < chunk_count; idx++) {
     /* size & ranges */
     info_ptr->chunks[idx].size = info_ptr->params->chunk_size;
     info_ptr->chunks[idx].range_start = (off_t)idx * info_ptr->chunks[idx].size;
     info_ptr->chunks[idx].range_end = (off_t)(idx+1) * info_ptr->chunks[idx].size - 1;
-    if (info_ptr->is_ftp && info_ptr->params->allow_ftp_segments) {
-      info_ptr->chunks[idx].unsafe_range_size_check = true;
-    }
   }
 
   if (info_ptr->rem_size) {
@@ -141,15 +152,18 @@ void chunks_init(info_s *info_ptr) {
     info_ptr->chunks[idx].range_end = info_ptr->file_size - 1;
   }
 
-  for (size_t idx = 0; idx < chunk_count; idx++) {
+  for (size_t idx = 0; idx < chunk_count + info_ptr->max_sub_chunks; idx++) {
+    info_ptr->chunks[idx].idx = idx;
+
+    if (info_ptr->is_ftp && info_ptr->params->allow_ftp_segments) {
+      info_ptr->chunks[idx].unsafe_range_size_check = true;
+    }
+
     /* events */
-    info_ptr->chunks[idx].ev_trigger = &info_ptr->ev_trigger;
-    info_ptr->chunks[idx].ev_merge = &info_ptr->ev_merge;
-    info_ptr->chunks[idx].ev_queue = &info_ptr->ev_queue;
-    info_ptr->chunks[idx].ev_ctrl = &info_ptr->ev_ctrl;
-    info_ptr->chunks[idx].ev_status = &info_ptr->ev_status;
+    info_ptr->chunks[idx].events = &info_ptr->events;
   }
 
+  prg_index_init(info_ptr);
 }
 
 static void remote_info_from_headers(info_s *info_ptr, remote_info_s *remote_info) {
@@ -217,6 +231,21 @@ static void remote_info_from_headers(info_s *info_ptr, remote_info_s *remote_inf
     SALDL_FREE(h->content_type);
   }
 
+  /* Validators, saved in ctrl files to detect remote file changes when resuming */
+  if (h->etag) {
+    debug_msg(FN, "ETag: %s", h->etag);
+    SALDL_FREE(remote_info->etag);
+    remote_info->etag = h->etag;
+    h->etag = NULL;
+  }
+
+  if (h->last_modified) {
+    debug_msg(FN, "Last-Modified: %s", h->last_modified);
+    SALDL_FREE(remote_info->last_modified);
+    remote_info->last_modified = h->last_modified;
+    h->last_modified = NULL;
+  }
+
   if (h->content_disposition) {
     char *tmp;
     debug_msg(FN, "Content-Disposition: %s", h->content_disposition);
@@ -300,6 +329,18 @@ static size_t  header_function(  void  *ptr,  size_t  size, size_t nmemb, void *
     h->content_disposition = saldl_strdup(h_info);
   }
 
+  if (strcasestr(header, "ETag:") == header) {
+    char *h_info = saldl_lstrip(header + strlen("ETag:"));
+    SALDL_FREE(h->etag);
+    h->etag = saldl_strdup(h_info);
+  }
+
+  if (strcasestr(header, "Last-Modified:") == header) {
+    char *h_info = saldl_lstrip(header + strlen("Last-Modified:"));
+    SALDL_FREE(h->last_modified);
+    h->last_modified = saldl_strdup(h_info);
+  }
+
   SALDL_FREE(header);
   return size * nmemb;
 }
@@ -671,6 +712,49 @@ static bool mirror_is_valid(info_s *info_ptr) {
 
 }
 
+static bool request_remote_info_zero_probe(info_s *info_ptr, thread_s *tmp) {
+  /*
+   * Request the whole file, and take remote info from the response headers.
+   * The transfer is paused when the body starts, and continued later by the
+   * connection downloading the first chunk.
+   */
+  SALDL_ASSERT(info_ptr);
+  SALDL_ASSERT(tmp);
+
+  saldl_params *params_ptr = info_ptr->params;
+  remote_info_s *remote_info = &info_ptr->remote_info;
+  long response = 0;
+
+  SALDL_ASSERT(params_ptr);
+
+  if (params_ptr->mirror_start_url || params_ptr->head) {
+    info_msg(FN, "Zero-probe can't be used with a mirror URL or HEAD requests, disabling.");
+    params_ptr->zero_probe = false;
+    return false;
+  }
+
+  debug_msg(FN, "Requesting the whole file, remote info will be taken from the response.");
+  curl_easy_setopt(tmp->ehandle, CURLOPT_RANGE, "0-");
+
+  if (!multi_probe(info_ptr, tmp)) {
+    warn_msg(FN, "Zero-probe request returned no data, falling back to separate info requests.");
+    params_ptr->zero_probe = false;
+    set_write_opts(tmp->ehandle, NULL, params_ptr, true);
+    return false;
+  }
+
+  curl_easy_getinfo(tmp->ehandle, CURLINFO_RESPONSE_CODE, &response);
+  debug_msg(FN, "response=%ld", response);
+
+  /* Content-Range is cleared in remote_info_from_headers() */
+  remote_info->range_support = params_ptr->assume_range_support ||
+    (response == 206 && info_ptr->headers.content_range);
+
+  remote_info_from_headers(info_ptr, remote_info);
+  set_info_params_from_remote_info(info_ptr, remote_info);
+  return true;
+}
+
 static void request_remote_info(info_s *info_ptr, thread_s *tmp) {
   /*
    * Check remote info with range support in one request.
@@ -770,10 +854,18 @@ void get_info(info_s *info_ptr) {
   }
 
   set_write_opts(tmp.ehandle, NULL, params_ptr, true);
-  request_remote_info(info_ptr, &tmp);
 
-  curl_slist_free_all(tmp.header_list);
-  curl_easy_cleanup(tmp.ehandle);
+  if (params_ptr->zero_probe && request_remote_info_zero_probe(info_ptr, &tmp)) {
+    /* Kept until a connection takes it over, see multi_adopt_probe() */
+    info_ptr->probe = tmp;
+    curl_easy_setopt(info_ptr->probe.ehandle, CURLOPT_ERRORBUFFER, info_ptr->probe.err_buf);
+  }
+  else {
+    request_remote_info(info_ptr, &tmp);
+
+    curl_slist_free_all(tmp.header_list);
+    curl_easy_cleanup(tmp.ehandle);
+  }
   /* remote part ends here */
 
 no_remote:
@@ -790,10 +882,182 @@ void check_remote_file_size(info_s *info_ptr) {
     set_single_mode(info_ptr);
   }
 
+  if (params_ptr->direct_writes) {
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+    if (params_ptr->single_mode || params_ptr->mem_bufs || params_ptr->to_stdout || params_ptr->read_only) {
+      info_msg(FN, "Direct writes only replace tmp files in the default mode, disabling.");
+      params_ptr->direct_writes = false;
+    }
+#else
+    warn_msg(FN, "Direct writes are not supported in this build, disabling.");
+    params_ptr->direct_writes = false;
+#endif
+  }
+
+  if (params_ptr->io_uring) {
+#ifdef HAVE_IO_URING
+    if (!params_ptr->direct_writes) {
+      info_msg(FN, "io_uring is only used for direct writes, disabling.");
+      params_ptr->io_uring = false;
+    }
+#else
+    warn_msg(FN, "io_uring is not supported in this build, disabling.");
+    params_ptr->io_uring = false;
+#endif
+  }
+
+  if (params_ptr->mmap_writes) {
+#ifdef HAVE_MMAP
+    if (!params_ptr->direct_writes || params_ptr->io_uring || params_ptr->o_direct) {
+      info_msg(FN, "mmap writes only replace direct writes without io_uring or O_DIRECT, disabling.");
+      params_ptr->mmap_writes = false;
+    }
+#else
+    warn_msg(FN, "mmap writes are not supported in this build, disabling.");
+    params_ptr->mmap_writes = false;
+#endif
+  }
+
+  if (params_ptr->o_direct) {
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+    if (!params_ptr->direct_writes || params_ptr->io_uring || !info_ptr->o_direct_align) {
+      info_msg(FN, "O_DIRECT is only used for direct writes without io_uring, disabling.");
+      params_ptr->o_direct = false;
+    }
+#else
+    warn_msg(FN, "O_DIRECT is not supported in this build, disabling.");
+    params_ptr->o_direct = false;
+#endif
+  }
+
+  if (params_ptr->drop_cache) {
+#ifdef HAVE_POSIX_FADVISE
+    if (params_ptr->to_stdout || params_ptr->read_only) {
+      info_msg(FN, "Dropping cached pages only applies to saved files, disabling.");
+      params_ptr->drop_cache = false;
+    }
+#else
+    warn_msg(FN, "Dropping cached pages is not supported in this build, disabling.");
+    params_ptr->drop_cache = false;
+#endif
+  }
+
+  if (params_ptr->work_stealing) {
+    if (params_ptr->single_mode || params_ptr->to_stdout || params_ptr->merge_in_order || params_ptr->read_only) {
+      info_msg(FN, "Work stealing can't be used with single mode, in-order merging or read-only, disabling.");
+      params_ptr->work_stealing = false;
+    }
+  }
+
+  if (params_ptr->endgame) {
+    if (!params_ptr->direct_writes) {
+      info_msg(FN, "Endgame hedging needs direct writes, as both copies of a range are written in place, disabling.");
+      params_ptr->endgame = false;
+    }
+  }
+
+  if (params_ptr->adaptive_chunks && params_ptr->single_mode) {
+    info_msg(FN, "Adaptive chunks can't be used with single mode, disabling.");
+    params_ptr->adaptive_chunks = 0;
+  }
+
+  if ((params_ptr->handoff_size || params_ptr->handoff_time) && params_ptr->single_mode) {
+    info_msg(FN, "Handoff needs more than one chunk, disabling.");
+    params_ptr->handoff_size = 0;
+    params_ptr->handoff_time = 0;
+  }
+
   if (info_ptr->chunk_count > 1 && info_ptr->chunk_count < info_ptr->params->num_connections) {
     info_msg(NULL, "File relatively small, use %"SAL_ZU" connection(s)", info_ptr->chunk_count);
     info_ptr->params->num_connections = info_ptr->chunk_count;
   }
+
+  if (params_ptr->max_connections) {
+    params_ptr->max_connections = saldl_min(params_ptr->max_connections, info_ptr->chunk_count);
+
+    if (params_ptr->single_mode || params_ptr->max_connections <= params_ptr->num_connections) {
+      info_msg(FN, "Max connections not above the number of connections, disabling.");
+      params_ptr->max_connections = 0;
+    }
+    else {
+      /* Connections are allocated for the max, the AIMD controller picks how many are used */
+      info_ptr->aimd.target = params_ptr->num_connections;
+      params_ptr->num_connections = params_ptr->max_connections;
+    }
+  }
+
+  if (params_ptr->multiplex) {
+    if (params_ptr->single_mode || params_ptr->no_http2 || !(info_ptr->curl_info->features & CURL_VERSION_HTTP2)) {
+      info_msg(FN, "Multiplexing needs HTTP/2 support and more than one chunk, disabling.");
+      params_ptr->multiplex = 0;
+    }
+    else if (params_ptr->multiplex >= params_ptr->num_connections) {
+      info_msg(FN, "Multiplexing needs fewer HTTP/2 connections than transfers (%"SAL_ZU"), disabling.", params_ptr->num_connections);
+      params_ptr->multiplex = 0;
+    }
+  }
+
+  if (params_ptr->evict_slow_period) {
+    if (params_ptr->single_mode || params_ptr->num_connections < SALDL_EVICT_MIN_PEERS) {
+      info_msg(FN, "Evicting slow connections needs at least %d connections, disabling.", SALDL_EVICT_MIN_PEERS);
+      params_ptr->evict_slow_period = 0;
+    }
+  }
+
+  /* Every connection gets a chunk in the 1st iteration */
+  off_t min_in_flight = (off_t)params_ptr->num_connections * (off_t)params_ptr->chunk_size;
+  bool in_order = params_ptr->to_stdout || params_ptr->merge_in_order;
+
+  if (params_ptr->reorder_window) {
+    if (params_ptr->single_mode || !in_order) {
+      info_msg(FN, "Reorder window only applies to in-order merging, disabling.");
+      params_ptr->reorder_window = 0;
+    }
+    else {
+      if (params_ptr->reorder_window < min_in_flight) {
+        info_msg(FN, "Reorder window raised to %.2f%s, one chunk per connection.",
+            human_size(min_in_flight), human_size_suffix(min_in_flight));
+        params_ptr->reorder_window = min_in_flight;
+      }
+
+      /* Also avoids overflowing the window's end */
+      params_ptr->reorder_window = saldl_min_o(params_ptr->reorder_window, info_ptr->file_size);
+    }
+  }
+
+  if (params_ptr->mem_bufs_limit) {
+    if (params_ptr->single_mode || !params_ptr->mem_bufs) {
+      info_msg(FN, "Memory buffers limit only applies with memory buffers, disabling.");
+      params_ptr->mem_bufs_limit = 0;
+    }
+    else if (params_ptr->mem_bufs_limit < min_in_flight) {
+      info_msg(FN, "Memory buffers limit raised to %.2f%s, one chunk per connection.",
+          human_size(min_in_flight), human_size_suffix(min_in_flight));
+      params_ptr->mem_bufs_limit = min_in_flight;
+    }
+  }
+
+  /* Chunks held back waiting for earlier ones to be merged must not starve them */
+  if (params_ptr->reorder_window || (params_ptr->mem_bufs_limit && in_order)) {
+    if (params_ptr->last_chunks_first || params_ptr->last_size_first || params_ptr->random_order) {
+      info_msg(FN, "Chunks are picked in order with a reorder window or a memory buffers limit, ignoring last chunks first and random order.");
+      params_ptr->last_chunks_first = 0;
+      params_ptr->last_size_first = 0;
+      params_ptr->random_order = false;
+    }
+  }
+
+  if (params_ptr->merge_workers) {
+#ifdef HAVE_PWRITE
+    if (params_ptr->single_mode || params_ptr->mem_bufs || params_ptr->direct_writes || params_ptr->read_only || in_order) {
+      info_msg(FN, "Merge workers only merge tmp files out of order, disabling.");
+      params_ptr->merge_workers = 0;
+    }
+#else
+    warn_msg(FN, "Merge workers are not supported in this build, disabling.");
+    params_ptr->merge_workers = 0;
+#endif
+  }
 }
 
 static void whole_file(info_s *info_ptr) {
@@ -849,9 +1113,27 @@ void set_info(info_s *info_ptr) {
 
   saldl_params *params_ptr = info_ptr->params;
 
+  /* Memory buffers are allocated for the chunk size */
+  if (params_ptr->adaptive_chunks && params_ptr->mem_bufs) {
+    info_msg(FN, "Adaptive chunks can't be used with memory buffers, disabling.");
+    params_ptr->adaptive_chunks = 0;
+  }
+
+  /* Requests are made of smaller chunks, sized by the rate of each connection */
+  if (params_ptr->adaptive_chunks) {
+    params_ptr->chunk_size += !params_ptr->chunk_size * (size_t)SALDL_ADAPTIVE_DEF_CHUNK_SIZE;
+
+    if (params_ptr->auto_size || params_ptr->whole_file) {
+      info_msg(FN, "Chunk size is not increased with adaptive chunks, ignoring auto size and whole file.");
+      params_ptr->auto_size = 0;
+      params_ptr->whole_file = false;
+    }
+  }
+
   /* I know this is a crazy way to set defaults */
   params_ptr->num_connections += !params_ptr->num_connections * (size_t)SALDL_DEF_NUM_CONNECTIONS;
   params_ptr->chunk_size += !params_ptr->chunk_size * (size_t)SALDL_DEF_CHUNK_SIZE;
+  params_ptr->write_buf_size += !params_ptr->write_buf_size * (size_t)SALDL_DEF_WRITE_BUFFER_SIZE;
 
   if (! params_ptr->single_mode) {
     if ( params_ptr->auto_size  ) {
@@ -881,6 +1163,23 @@ void set_info(info_s *info_ptr) {
     info_ptr->params->chunk_size = 4096;
   }
 
+  /* Chunks starting at block boundaries are merged into whole extents, and can be written with O_DIRECT */
+  if ((!params_ptr->no_preallocate || params_ptr->o_direct) && !params_ptr->to_stdout && !params_ptr->read_only) {
+    size_t block_size = saldl_fs_block_size(info_ptr->part_filename);
+
+    /* Written pages are not shared with buffered writes of other chunks */
+    if (params_ptr->o_direct) {
+      block_size = saldl_max(block_size, (size_t)sysconf(_SC_PAGESIZE));
+      info_ptr->o_direct_align = block_size;
+    }
+
+    if (block_size && params_ptr->chunk_size % block_size) {
+      size_t aligned_chunk_size = (params_ptr->chunk_size / block_size + 1) * block_size;
+      info_msg(FN, "Rounding up chunk_size from %"SAL_ZU" to %"SAL_ZU", a multiple of the filesystem block size.", params_ptr->chunk_size, aligned_chunk_size);
+      params_ptr->chunk_size = aligned_chunk_size;
+    }
+  }
+
   info_ptr->rem_size = (size_t)(info_ptr->file_size % (off_t)info_ptr->params->chunk_size);
   info_ptr->chunk_count = (size_t)(info_ptr->file_size / (off_t)info_ptr->params->chunk_size) + !!info_ptr->rem_size;
 
@@ -920,12 +1219,18 @@ void global_progress_update(info_s *info_ptr, bool init) {
     size_t empty_started = 0;
     size_t queued = 0;
     size_t not_started = 0;
-    for (idx = 0; idx < info_ptr->chunk_count; idx++) {
+    size_t chunk_count = prg_index_chunk_count(info_ptr);
+    for (idx = 0; idx < chunk_count; idx++) {
       chunk_s chunk = info_ptr->chunks[idx]; /* Important to get consistent info */
       total_complete_size += chunk.size_complete;
 
+      /* Sub-chunks only add to the size, their chunks' progress is counted */
+      if (idx >= info_ptr->chunk_count) {
+        continue;
+      }
+
       /* Status */
-      switch (chunk.progress) {
+      switch (chunk_layout_progress(&chunk)) {
         case PRG_MERGED:
           merged++;
           break;
@@ -1059,26 +1364,129 @@ static int status_single_display(void *void_info_ptr, curl_off_t dltotal, curl_o
   return 0;
 }
 
-static int chunk_progress(void *void_chunk_ptr, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+void slow_evict_init(info_s *info_ptr) {
+  slow_evict_s *slow_evict = &info_ptr->slow_evict;
+
+  slow_evict->threads = info_ptr->threads;
+  slow_evict->count = info_ptr->thread_count;
+  slow_evict->sorted = saldl_calloc(slow_evict->count, sizeof(size_t));
+  slow_evict->period = (double)info_ptr->params->evict_slow_period;
+  SALDL_ASSERT(!pthread_mutex_init(&slow_evict->mutex, NULL));
+
+  for (size_t counter = 0; counter < slow_evict->count; counter++) {
+    info_ptr->threads[counter].slow_evict = slow_evict;
+  }
+}
+
+void slow_evict_free(info_s *info_ptr) {
+  slow_evict_s *slow_evict = &info_ptr->slow_evict;
+
+  if (slow_evict->sorted) {
+    SALDL_ASSERT(!pthread_mutex_destroy(&slow_evict->mutex));
+  }
+
+  SALDL_FREE(slow_evict->sorted);
+}
+
+/* Find the median rate of connections sampled recently. Called with the mutex locked. */
+static void slow_evict_median(slow_evict_s *slow_evict, double now) {
+  size_t active = 0;
+
+  /* Insertion sort, there are only a few connections */
+  for (size_t counter = 0; counter < slow_evict->count; counter++) {
+    thread_s *thread = &slow_evict->threads[counter];
+
+    if (!thread->rate_stamp || now - thread->rate_stamp > SALDL_EVICT_ACTIVE_TIME) {
+      continue;
+    }
+
+    size_t idx = active++;
+    for (; idx && slow_evict->sorted[idx-1] > thread->rate; idx--) {
+      slow_evict->sorted[idx] = slow_evict->sorted[idx-1];
+    }
+    slow_evict->sorted[idx] = thread->rate;
+  }
+
+  /* Keep the last median for adapting low-speed timeouts, even if too few connections are active */
+  if (active >= SALDL_EVICT_MIN_PEERS) {
+    slow_evict->median = slow_evict->sorted[active/2];
+  }
+  slow_evict->active = active;
+  slow_evict->median_time = now;
+}
+
+/* Update the connection's EWMA rate, returns true if it should be evicted.
+ * The rate spans the connection's transfers, so short chunks are still sampled. */
+static bool slow_evict_check(thread_s *thread, curl_off_t dlnow, size_t rem) {
+  slow_evict_s *slow_evict = thread->slow_evict;
+  double now = saldl_utime();
+  bool evict = false;
+
+  /* dlnow restarts with each transfer */
+  thread->rate_bytes += dlnow - thread->rate_dlnow;
+  thread->rate_dlnow = dlnow;
+
+  if (!thread->rate_time) {
+    thread->rate_bytes = 0;
+    thread->rate_time = now;
+    return false;
+  }
+
+  double elapsed = now - thread->rate_time;
+  if (elapsed < SALDL_EVICT_SAMPLE_INTERVAL) {
+    return false;
+  }
+
+  size_t sample = (size_t)((double)thread->rate_bytes / elapsed);
+  thread->rate_bytes = 0;
+  thread->rate_time = now;
+
+  saldl_pthread_mutex_lock_retry_deadlock(&slow_evict->mutex);
+
+  thread->rate = thread->rate_stamp ?
+    (size_t)(SALDL_EVICT_EWMA_WEIGHT * sample + (1 - SALDL_EVICT_EWMA_WEIGHT) * thread->rate) : sample;
+  thread->rate_stamp = now;
+
+  if (now - slow_evict->median_time >= SALDL_EVICT_SAMPLE_INTERVAL) {
+    slow_evict_median(slow_evict, now);
+  }
+
+  if (slow_evict->active < SALDL_EVICT_MIN_PEERS || thread->rate >= slow_evict->median / SALDL_EVICT_SLOW_RATIO) {
+    thread->slow_since = 0;
+  }
+  else if (!thread->slow_since) {
+    thread->slow_since = now;
+  }
+  else {
+    evict = now - thread->slow_since >= slow_evict->period && rem >= SALDL_EVICT_MIN_SIZE;
+  }
+
+  saldl_pthread_mutex_unlock(&slow_evict->mutex);
+  return evict;
+}
+
+static int chunk_progress(void *void_thread_ptr, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
 
   SALDL_ASSERT(!ulnow);
   SALDL_ASSERT(!ultotal);
 
-  chunk_s *chunk =  (chunk_s *)void_chunk_ptr;
+  thread_s *thread = (thread_s *)void_thread_ptr;
+  chunk_s *chunk = thread->chunk;
   size_t rem;
 
   /* Check bad server behavior, e.g. if dltotal becomes file_size mid-transfer. */
   if (dltotal && !chunk->unsafe_range_size_check &&
-      dltotal != (chunk->range_end - chunk->curr_range_start + 1) ) {
-    fatal(FN, "Transfer size(%"SAL_JD") does not match requested range(%"SAL_JD"-%"SAL_JD") in chunk %"SAL_ZU", this is a sign of a bad server, retry with a single connection.", (intmax_t)dltotal, (intmax_t)chunk->curr_range_start, (intmax_t)chunk->range_end, chunk->idx);
+      dltotal != (chunk->curr_range_end - chunk->curr_range_start + 1) ) {
+    fatal(FN, "Transfer size(%"SAL_JD") does not match requested range(%"SAL_JD"-%"SAL_JD") in chunk %"SAL_ZU", this is a sign of a bad server, retry with a single connection.", (intmax_t)dltotal, (intmax_t)chunk->curr_range_start, (intmax_t)chunk->curr_range_end, chunk->idx);
   }
 
   if (dlnow) { /* dltotal & dlnow can both be 0 initially */
-    curl_off_t curr_chunk_size = chunk->range_end - chunk->curr_range_start + 1;
+    curl_off_t curr_chunk_size = chunk->curr_range_end - chunk->curr_range_start + 1;
+    curl_off_t stolen_size = chunk->curr_range_end - chunk->range_end; /* non-zero if shrunk by work stealing */
     if (dltotal != curr_chunk_size) {
       fatal(FN, "Transfer size does not equal requested range: %"SAL_JD"!=%"SAL_JD" for chunk %"SAL_ZU", this is a sign of a bad server, retry with a single connection.", (intmax_t)dltotal, (intmax_t)curr_chunk_size, chunk->idx);
     }
-    rem = (size_t)(dltotal-dlnow);
+    rem = (size_t)saldl_max_o(dltotal - dlnow - stolen_size, 0);
   } else if (chunk->size_complete) { /* dltotal & dlnow can also both be 0 initially if a chunk download restarted */
     rem = chunk->size - chunk->size_complete;
   } else {
@@ -1086,6 +1494,31 @@ static int chunk_progress(void *void_chunk_ptr, curl_off_t dltotal, curl_off_t d
   }
   chunk->size_complete = chunk->size - rem;
 
+  /* Endgame: the other copy of this range finished first, also if stalled */
+  if (__atomic_load_n(&chunk->hedge_lost, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+
+  /* Continue a transfer paused at the end of the reorder window, if the window moved.
+   * libcurl keeps calling this while the transfer is paused. */
+  if (thread->reorder_paused && chunk->curr_pos < __atomic_load_n(thread->reorder_limit, __ATOMIC_ACQUIRE)) {
+    thread->reorder_paused = false;
+    if (curl_easy_pause(thread->ehandle, CURLPAUSE_CONT)) {
+      return 1;
+    }
+  }
+
+  /* Paused transfers are not slow, sampling restarts when they continue */
+  if (thread->slow_evict && thread->reorder_paused) {
+    thread->rate_dlnow = dlnow;
+    thread->rate_time = 0;
+    thread->slow_since = 0;
+  }
+  else if (thread->slow_evict && slow_evict_check(thread, dlnow, rem)) {
+    thread->evicted = true;
+    return 1;
+  }
+
   return 0;
 }
 
@@ -1099,11 +1532,29 @@ void set_progress_params(thread_s *thread, info_s *info_ptr) {
     curl_easy_setopt(thread->ehandle,CURLOPT_NOPROGRESS,0l);
   } else if (thread->chunk && thread->chunk->size) {
     curl_easy_setopt(thread->ehandle, CURLOPT_XFERINFOFUNCTION, chunk_progress);
-    curl_easy_setopt(thread->ehandle,CURLOPT_XFERINFODATA, thread->chunk);
+    curl_easy_setopt(thread->ehandle,CURLOPT_XFERINFODATA, thread);
     curl_easy_setopt(thread->ehandle,CURLOPT_NOPROGRESS,0l);
   }
 }
 
+/* Per chunk settings of a connection with --evict-slow */
+void slow_evict_prep(thread_s *thread, info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+
+  /* Only the chunk of an evicted connection is continued on a new one */
+  curl_easy_setopt(thread->ehandle, CURLOPT_FRESH_CONNECT, 0l);
+
+  /* Adapt the low-speed timeout to the connections' observed throughput */
+  if (!params_ptr->no_timeouts && !params_ptr->timeout_low_speed) {
+    saldl_pthread_mutex_lock_retry_deadlock(&info_ptr->slow_evict.mutex);
+    size_t median = info_ptr->slow_evict.median;
+    saldl_pthread_mutex_unlock(&info_ptr->slow_evict.mutex);
+
+    long low_speed = (long)saldl_max_z_umax(median / SALDL_EVICT_SLOW_RATIO, 512);
+    curl_easy_setopt(thread->ehandle, CURLOPT_LOW_SPEED_LIMIT, low_speed);
+  }
+}
+
 void set_params(thread_s *thread, info_s *info_ptr, char *url) {
   saldl_params *params_ptr = info_ptr->params;
 
@@ -1115,6 +1566,11 @@ void set_params(thread_s *thread, info_s *info_ptr, char *url) {
   curl_easy_setopt(thread->ehandle, CURLOPT_URL, url);
   curl_easy_setopt(thread->ehandle, CURLOPT_ERRORBUFFER, thread->err_buf);
 
+  /* Must be set before inline cookies are added to the cookie jar */
+  if (info_ptr->share_handle) {
+    curl_easy_setopt(thread->ehandle, CURLOPT_SHARE, info_ptr->share_handle);
+  }
+
 #if !defined(__CYGWIN__) && !defined(__MSYS__) && defined(HAVE_GETMODULEFILENAME)
   /* Set CA bundle if the file exists */
   char ca_bundle_path[PATH_MAX];
@@ -1156,6 +1612,12 @@ void set_params(thread_s *thread, info_s *info_ptr, char *url) {
       /* Default: Use HTTP/2 over TLS if available */
       curl_easy_setopt(thread->ehandle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
     }
+
+    /* With --multiplex, wait for a connection that can take another stream,
+     * instead of opening a new one */
+    if (params_ptr->multiplex) {
+      curl_easy_setopt(thread->ehandle, CURLOPT_PIPEWAIT, 1l);
+    }
   }
 
   /* For our use-cases, Nagle's algorithm seems to have negative or
@@ -1165,6 +1627,12 @@ void set_params(thread_s *thread, info_s *info_ptr, char *url) {
    */
   curl_easy_setopt(thread->ehandle, CURLOPT_TCP_NODELAY, 1l);
 
+  /* Send the request with the SYN when reconnecting to a server.
+   * Not supported on all platforms, so don't care about the return value. */
+  if (params_ptr->tcp_fastopen) {
+    curl_easy_setopt(thread->ehandle, CURLOPT_TCP_FASTOPEN, 1l);
+  }
+
   /* Enable TCP keep-alive by default, and use a short interval (6s) between probes */
   if (!params_ptr->no_tcp_keep_alive) {
     curl_easy_setopt(thread->ehandle, CURLOPT_TCP_KEEPALIVE, 1l);
@@ -1216,17 +1684,24 @@ void set_params(thread_s *thread, info_s *info_ptr, char *url) {
   curl_easy_setopt(thread->ehandle, CURLOPT_HEADEROPT, CURLHEADER_SEPARATE);
   curl_easy_setopt(thread->ehandle, CURLOPT_HTTPHEADER, thread->header_list);
 
-  if (params_ptr->cookie_file) {
+  /* With a shared cookie jar, cookies only need to be loaded by the
+   * first handle (the probe handle, or the only handle with --no-remote-info).
+   */
+  if (params_ptr->cookie_file && !info_ptr->cookies_loaded) {
     curl_easy_setopt(thread->ehandle, CURLOPT_COOKIEFILE, params_ptr->cookie_file);
   } else {
     /* Just enable the cookie engine */
     curl_easy_setopt(thread->ehandle, CURLOPT_COOKIEFILE, "");
   }
 
-  if (params_ptr->inline_cookies) {
+  if (params_ptr->inline_cookies && !info_ptr->cookies_loaded) {
     set_inline_cookies(thread->ehandle, params_ptr->inline_cookies);
   }
 
+  if (info_ptr->shared_cookies) {
+    info_ptr->cookies_loaded = true;
+  }
+
 
   curl_easy_setopt(thread->ehandle,CURLOPT_NOSIGNAL,1l); /* Try to avoid threading related segfaults */
   curl_easy_setopt(thread->ehandle,CURLOPT_FAILONERROR,1l); /* Fail on 4xx errors */
@@ -1319,6 +1794,27 @@ void set_single_mode(info_s *info_ptr) {
   info_ptr->rem_size = 0;
 }
 
+/* Allocate the whole part file up-front, to avoid fragmenting it by merging
+ * chunks out of order, and to run out of space before downloading anything */
+static void preallocate_part_file(info_s *info_ptr) {
+  int ret;
+
+  if (info_ptr->file_size <= 0) {
+    return;
+  }
+
+  /* Single mode resumes from the part file's size */
+  ret = saldl_preallocate(fileno(info_ptr->file), info_ptr->file_size, info_ptr->params->single_mode);
+
+  if (ret == ENOSPC) {
+    fatal(FN, "Not enough space for %s (%.2f%s).", info_ptr->part_filename,
+        human_size(info_ptr->file_size), human_size_suffix(info_ptr->file_size));
+  }
+  else if (ret) {
+    debug_msg(FN, "Preallocating %s failed: %s", info_ptr->part_filename, strerror(ret));
+  }
+}
+
 void check_files_and_dirs(info_s *info_ptr) {
   saldl_params *params_ptr = info_ptr->params;
 
@@ -1340,15 +1836,25 @@ void check_files_and_dirs(info_s *info_ptr) {
       if ( !params_ptr->force  && !access(info_ptr->part_filename,F_OK)) {
         fatal(FN, "%s exists, enable 'resume' or 'force' to overwrite.", info_ptr->part_filename);
       }
-      if ( !(info_ptr->file = fopen(info_ptr->part_filename,"wb")) ) {
+      /* Shared writable mappings require a file opened for reading too */
+      if ( !(info_ptr->file = fopen(info_ptr->part_filename, params_ptr->mmap_writes ? "wb+" : "wb")) ) {
         fatal(FN, "Failed to open %s for writing: %s", info_ptr->part_filename, strerror(errno));
       }
     }
+
+    /* Single mode writes to the part file directly */
+    if (params_ptr->single_mode) {
+      info_ptr->storage_info.buf = saldl_setvbuf(info_ptr->part_filename, info_ptr->file, params_ptr->write_buf_size);
+    }
+
+    if (!params_ptr->no_preallocate) {
+      preallocate_part_file(info_ptr);
+    }
   }
 
   /* if tmp dir exists */
   if (! access(info_ptr->tmp_dirname, F_OK) ) {
-    if (params_ptr->mem_bufs || params_ptr->single_mode) {
+    if (params_ptr->mem_bufs || params_ptr->direct_writes || params_ptr->single_mode) {
       warn_msg(FN, "%s seems to be left over. You have to delete this dir manually.", info_ptr->tmp_dirname);
     }
     else if (!info_ptr->extra_resume_set) {
@@ -1361,9 +1867,9 @@ void check_files_and_dirs(info_s *info_ptr) {
     }
   }
   /* if dir does not exist */
-  else if (!params_ptr->mem_bufs && !params_ptr->single_mode) {
+  else if (!params_ptr->mem_bufs && !params_ptr->direct_writes && !params_ptr->single_mode) {
     if (info_ptr->extra_resume_set) {
-      warn_msg(FN, "%s did not exist. Maybe previous run used memory buffers or the dir was deleted manually.", info_ptr->tmp_dirname);
+      warn_msg(FN, "%s did not exist. Maybe previous run used memory buffers or direct writes, or the dir was deleted manually.", info_ptr->tmp_dirname);
     }
     /* mkdir with 700 perms */
     if ( saldl_mkdir(info_ptr->tmp_dirname, S_IRWXU) ) {
@@ -1385,16 +1891,124 @@ void check_files_and_dirs(info_s *info_ptr) {
   }
 }
 
-void saldl_perform(thread_s *thread) {
-  CURLcode ret;
+void saldl_perform_reset(thread_s *thread) {
+  thread->retries = 0;
+  thread->semi_fatal_retries = 0;
+  thread->delay = init_delay;
+  thread->retry_time = 0;
+  thread->open_ended = false;
+  thread->reorder_paused = false;
+  thread->evicted = false;
+}
+
+enum PERFORM_RESULT saldl_perform_check(thread_s *thread, CURLcode ret) {
   long response;
-  short semi_fatal_retries = 0;
 
-  size_t retries = 0;
-  const size_t max_delay = 32;
-  const size_t init_delay = 1;
-  size_t delay = init_delay;
+  /* The next transfer's dlnow starts from 0 */
+  thread->rate_dlnow = 0;
+
+  /* Endgame: stopped as the other copy of this range finished first */
+  if (__atomic_load_n(&thread->chunk->hedge_lost, __ATOMIC_ACQUIRE)) {
+    return PERFORM_DONE;
+  }
+
+  /* Stopped from chunk_progress() as the connection was far slower than the others */
+  if (ret == CURLE_ABORTED_BY_CALLBACK && thread->evicted) {
+    thread->evicted = false;
+    thread->slow_since = 0;
+    info_msg(FN, "Connection downloading chunk %"SAL_ZU" is too slow, reconnecting.", thread->chunk->idx);
+    return PERFORM_RECONNECT;
+  }
 
+  /* The chunk was shrunk by work stealing, and the rest of the transfer was rejected */
+  if (ret == CURLE_WRITE_ERROR && thread->chunk->curr_pos > thread->chunk->range_end) {
+    thread->chunk->size_complete = thread->chunk->size;
+    return PERFORM_DONE;
+  }
+
+  /* Everything went okay */
+  if (ret == CURLE_OK && thread->chunk->size_complete == thread->chunk->size) {
+    return PERFORM_DONE;
+  }
+
+  switch (ret) {
+    case CURLE_OK:
+      if (thread->chunk->size) {
+        if (!thread->chunk->size_complete) {
+          /* This happens sometimes, especially when tunneling through proxies! Consider it non-fatal and retry */
+          info_msg(FN, "libcurl returned CURLE_OK for chunk %"SAL_ZU" before getting any data , restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", thread->chunk->idx, ++thread->retries, thread->delay);
+          return PERFORM_RESTART;
+        }
+        else {
+          /* Trust libcurl here if single mode */
+          if (thread->single) {
+            warn_msg(FN, "Returned CURLE_OK, but completed size(%"SAL_ZU") != requested size(%"SAL_ZU").",
+                thread->chunk->size_complete, thread->chunk->size);
+            warn_msg(FN, "We trust libcurl and assume that's okay if single mode.");
+            return PERFORM_DONE;
+          }
+          else {
+            fatal(FN, "Returned CURLE_OK for chunk %"SAL_ZU", but completed size(%"SAL_ZU") != requested size(%"SAL_ZU").",
+                thread->chunk->idx ,thread->chunk->size_complete, thread->chunk->size);
+          }
+        }
+      }
+      return PERFORM_DONE; // Avoid endless loop if server does not report file size
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR: // 55: SSL_write() returned SYSCALL, errno = 32
+      thread->semi_fatal_retries++;
+      thread->retries++;
+      if (thread->semi_fatal_retries <= MAX_SEMI_FATAL_RETRIES) {
+        warn_msg(FN, "libcurl returned semi-fatal (%d: %s) \
+            while downloading chunk %"SAL_ZU", retry %d/%d, delay=%"SAL_ZU".",
+            ret, thread->err_buf, thread->chunk->idx,
+            thread->semi_fatal_retries, MAX_SEMI_FATAL_RETRIES, thread->delay);
+        return PERFORM_RETRY;
+      } else {
+        fatal(NULL, "libcurl returned semi-fatal (%d: %s) while downloading chunk %"SAL_ZU", max semi-fatal retries %u exceeded.", ret, thread->err_buf, thread->chunk->idx, MAX_SEMI_FATAL_RETRIES);
+      }
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE: /* single mode */
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP_RETURNED_ERROR:
+      if (ret == CURLE_HTTP_RETURNED_ERROR) {
+        curl_easy_getinfo(thread->ehandle, CURLINFO_RESPONSE_CODE, &response);
+        if (response == 429 || response == 503) {
+          /* Consumed by the AIMD controller with --max-connections */
+          __atomic_store_n(&thread->throttled, true, __ATOMIC_RELAXED);
+        }
+
+        if (response < 500 && response != 429) {
+          fatal(NULL, "libcurl returned fatal error (%d: %s) while downloading chunk %"SAL_ZU".", ret, thread->err_buf, thread->chunk->idx);
+        } else {
+          info_msg(NULL, "libcurl returned (%d: %s) while downloading chunk %"SAL_ZU", restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", ret, thread->err_buf, thread->chunk->idx, ++thread->retries, thread->delay);
+        }
+      } else {
+        info_msg(NULL, "libcurl returned (%d: %s) while downloading chunk %"SAL_ZU", restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", ret, thread->err_buf, thread->chunk->idx, ++thread->retries, thread->delay);
+      }
+      return PERFORM_RETRY;
+    default:
+      fatal(NULL, "libcurl returned fatal error (%d: %s) while downloading chunk %"SAL_ZU".", ret, thread->err_buf, thread->chunk->idx);
+  }
+}
+
+void saldl_perform_retry(thread_s *thread) {
+  thread->reset_storage(thread);
+  thread->delay *= 2;
+  if (thread->delay > max_delay) thread->delay = init_delay;
+}
+
+void saldl_perform_reconnect(thread_s *thread) {
+  /* Don't reuse the slow connection, or one to the same slow path if pooled */
+  curl_easy_setopt(thread->ehandle, CURLOPT_FRESH_CONNECT, 1l);
+  thread->reset_storage(thread);
+}
+
+void saldl_perform(thread_s *thread) {
+  CURLcode ret;
 
   while (1) {
 
@@ -1414,78 +2028,20 @@ void saldl_perform(thread_s *thread) {
     restore_sig_handler(SIGPIPE, &sa_orig);
 #endif
 
-    /* Break if everything went okay */
-    if (ret == CURLE_OK && thread->chunk->size_complete == thread->chunk->size) {
-      goto saldl_perform_success;
-    }
-
-    switch (ret) {
-      case CURLE_OK:
-        if (thread->chunk->size) {
-          if (!thread->chunk->size_complete) {
-            /* This happens sometimes, especially when tunneling through proxies! Consider it non-fatal and retry */
-            info_msg(FN, "libcurl returned CURLE_OK for chunk %"SAL_ZU" before getting any data , restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", thread->chunk->idx, ++retries, delay);
-          }
-          else {
-            /* Trust libcurl here if single mode */
-            if (thread->single) {
-              warn_msg(FN, "Returned CURLE_OK, but completed size(%"SAL_ZU") != requested size(%"SAL_ZU").",
-                  thread->chunk->size_complete, thread->chunk->size);
-              warn_msg(FN, "We trust libcurl and assume that's okay if single mode.");
-              goto saldl_perform_success;
-            }
-            else {
-              fatal(FN, "Returned CURLE_OK for chunk %"SAL_ZU", but completed size(%"SAL_ZU") != requested size(%"SAL_ZU").",
-                  thread->chunk->idx ,thread->chunk->size_complete, thread->chunk->size);
-            }
-          }
-        }
-        else {
-          return; // Avoid endless loop if server does not report file size
-        }
+    switch (saldl_perform_check(thread, ret)) {
+      case PERFORM_DONE:
+        return;
+      case PERFORM_RETRY:
+        sleep(thread->delay);
+        saldl_perform_retry(thread);
         break;
-      case CURLE_SSL_CONNECT_ERROR:
-      case CURLE_SEND_ERROR: // 55: SSL_write() returned SYSCALL, errno = 32
-        semi_fatal_retries++;
-        retries++;
-        if (semi_fatal_retries <= MAX_SEMI_FATAL_RETRIES) {
-          warn_msg(FN, "libcurl returned semi-fatal (%d: %s) \
-              while downloading chunk %"SAL_ZU", retry %d/%d, delay=%"SAL_ZU".",
-              ret, thread->err_buf, thread->chunk->idx,
-              semi_fatal_retries, MAX_SEMI_FATAL_RETRIES, delay);
-          goto semi_fatal_perform_retry;
-        } else {
-          fatal(NULL, "libcurl returned semi-fatal (%d: %s) while downloading chunk %"SAL_ZU", max semi-fatal retries %u exceeded.", ret, thread->err_buf, thread->chunk->idx, MAX_SEMI_FATAL_RETRIES);
-        }
-      case CURLE_OPERATION_TIMEDOUT:
-      case CURLE_PARTIAL_FILE: /* single mode */
-      case CURLE_COULDNT_RESOLVE_HOST:
-      case CURLE_COULDNT_CONNECT:
-      case CURLE_GOT_NOTHING:
-      case CURLE_RECV_ERROR:
-      case CURLE_HTTP_RETURNED_ERROR:
-        if (ret == CURLE_HTTP_RETURNED_ERROR) {
-          curl_easy_getinfo(thread->ehandle, CURLINFO_RESPONSE_CODE, &response);
-          if (response < 500) {
-            fatal(NULL, "libcurl returned fatal error (%d: %s) while downloading chunk %"SAL_ZU".", ret, thread->err_buf, thread->chunk->idx);
-          } else {
-            info_msg(NULL, "libcurl returned (%d: %s) while downloading chunk %"SAL_ZU", restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", ret, thread->err_buf, thread->chunk->idx, ++retries, delay);
-          }
-        } else {
-          info_msg(NULL, "libcurl returned (%d: %s) while downloading chunk %"SAL_ZU", restarting (retry %"SAL_ZU", delay=%"SAL_ZU").", ret, thread->err_buf, thread->chunk->idx, ++retries, delay);
-        }
-semi_fatal_perform_retry:
-        sleep(delay);
-        thread->reset_storage(thread);
-        delay *= 2;
-        if (delay > max_delay) delay = init_delay;
+      case PERFORM_RESTART:
         break;
-      default:
-        fatal(NULL, "libcurl returned fatal error (%d: %s) while downloading chunk %"SAL_ZU".", ret, thread->err_buf, thread->chunk->idx);
+      case PERFORM_RECONNECT:
+        saldl_perform_reconnect(thread);
         break;
     }
   }
-saldl_perform_success: ;
 }
 
 void* thread_func(void* threadS) {
@@ -1498,17 +2054,27 @@ void* thread_func(void* threadS) {
   thread_s* tmp = threadS;
   set_chunk_progress(tmp->chunk, PRG_STARTED);
   saldl_perform(tmp);
+  hedge_settle(tmp);
   set_chunk_progress(tmp->chunk, PRG_FINISHED);
   return threadS;
 }
 
 void curl_cleanup(info_s *info_ptr) {
 
-  for (size_t counter = 0; counter < info_ptr->params->num_connections; counter++) {
+  /* Before the multi and share handles they were used with */
+  prewarm_free(info_ptr);
+
+  if (info_ptr->multi_handle) {
+    multi_discard_probe(info_ptr);
+    curl_multi_cleanup(info_ptr->multi_handle);
+  }
+
+  for (size_t counter = 0; counter < info_ptr->thread_count; counter++) {
     curl_slist_free_all(info_ptr->threads[counter].header_list);
     curl_easy_cleanup(info_ptr->threads[counter].ehandle);
   }
 
+  share_cleanup(info_ptr);
   curl_global_cleanup();
 }
 
@@ -26,6 +26,14 @@
 #include "write_modes.h"
 #include "merge.h"
 
+/* What to do with a chunk after its transfer returned */
+enum PERFORM_RESULT {
+  PERFORM_DONE = 0,
+  PERFORM_RETRY = 1, /* reset storage and retry after thread->delay */
+  PERFORM_RESTART = 2, /* retry right away */
+  PERFORM_RECONNECT = 3 /* reset storage and retry right away on a new connection */
+};
+
 char* saldl_user_agent();
 void chunks_init(info_s*);
 void check_remote_file_size(info_s*);
@@ -37,8 +45,15 @@ void global_progress_init(info_s*);
 void global_progress_update(info_s *info_ptr, bool init);
 void set_params(thread_s *thread, info_s *info_ptr, char *url);
 void set_progress_params(thread_s*, info_s*);
+void slow_evict_init(info_s*);
+void slow_evict_free(info_s*);
+void slow_evict_prep(thread_s*, info_s*);
 void set_single_mode(info_s*);
 void check_files_and_dirs(info_s *info_ptr);
+void saldl_perform_reset(thread_s*);
+enum PERFORM_RESULT saldl_perform_check(thread_s*, CURLcode);
+void saldl_perform_retry(thread_s*);
+void saldl_perform_reconnect(thread_s*);
 void saldl_perform(thread_s*);
 void* thread_func(void*);
 void curl_cleanup(info_s*);
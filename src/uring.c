@@ -0,0 +1,400 @@
+/*
+    This file is a part of saldl.
+
+    Copyright (C) 2014-2016 Mohammad AlSaleh <CE.Mohammad.AlSaleh at gmail.com>
+    https://saldl.github.io
+
+    saldl is free software: you can redistribute it and/or modify
+    it under the terms of the Affero GNU General Public License as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    Affero GNU General Public License for more details.
+
+    You should have received a copy of the Affero GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Chunk data is copied to registered buffers, which are written to the part file
+ * by the kernel's workers. Connections only block if all their buffers are in flight.
+ *
+ * Requests are cancelled if the thread that submitted them exits, and connection
+ * threads may exit before their writes complete. So filled buffers are handed over
+ * to the uring thread, which submits them, and reaps their completions.
+ *
+ * The raw syscalls are used, liburing is not required. */
+
+#define URING_WAKEUP 0 /* user_data of the eventfd poll */
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Called from the uring thread, submitted by the next uring_enter().
+ * The SQ can't be full, in-flight writes are bounded by buffers. */
+static struct io_uring_sqe* uring_get_sqe(uring_s *uring, uint8_t opcode, uint64_t user_data) {
+  struct io_uring_sqe *sqes = uring->sqes;
+  unsigned tail = *uring->sq_tail;
+  unsigned idx = tail & *uring->sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+
+  uring->sq_array[idx] = idx;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+static void uring_prep_write(uring_s *uring, uring_buf_s *buf) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring, uring->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, (uintptr_t)buf);
+
+  sqe->fd = buf->owner->fd;
+  sqe->addr = (uintptr_t)(buf->data + buf->written);
+  sqe->len = (uint32_t)(buf->size - buf->written);
+  sqe->off = (uint64_t)(buf->offset + (off_t)buf->written);
+  sqe->buf_index = (uint16_t)buf->idx;
+
+  /* Don't try the write inline, completions would wait for it */
+  sqe->flags = IOSQE_ASYNC;
+}
+
+static void uring_prep_wakeup(uring_s *uring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring, IORING_OP_POLL_ADD, URING_WAKEUP);
+
+  sqe->fd = uring->event_fd;
+  sqe->poll32_events = POLLIN;
+}
+
+/* Called with the mutex locked. Returns the number of prepared SQEs. */
+static unsigned uring_complete(uring_s *uring, struct io_uring_cqe *cqe) {
+  uring_buf_s *buf = (uring_buf_s*)(uintptr_t)cqe->user_data;
+  unsigned prepared = 0;
+
+  if (cqe->user_data == URING_WAKEUP) {
+    eventfd_t unused;
+    if (eventfd_read(uring->event_fd, &unused) && errno != EAGAIN) {
+      uring->error = errno;
+      return 0;
+    }
+
+    /* Submit filled buffers */
+    while (uring->filled_bufs) {
+      buf = uring->filled_bufs;
+      uring->filled_bufs = buf->next_free;
+      uring_prep_write(uring, buf);
+      prepared++;
+    }
+
+    if (!uring->stop) {
+      uring_prep_wakeup(uring);
+      prepared++;
+    }
+
+    return prepared;
+  }
+
+  if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+    uring_prep_write(uring, buf);
+    return 1;
+  }
+
+  if (cqe->res <= 0) {
+    uring->error = cqe->res ? -cqe->res : EIO;
+    return 0;
+  }
+
+  buf->written += (size_t)cqe->res;
+
+  if (buf->written < buf->size) {
+    uring_prep_write(uring, buf);
+    return 1;
+  }
+
+  buf->owner->in_flight--;
+  buf->owner = NULL;
+  buf->next_free = uring->free_bufs;
+  uring->free_bufs = buf;
+
+  return 0;
+}
+
+static void* uring_thread(void *void_uring) {
+  uring_s *uring = void_uring;
+  struct io_uring_cqe *cqes = uring->cqes;
+  unsigned to_submit = 0;
+  bool stop = false;
+
+  saldl_block_sig_pth();
+
+  uring_prep_wakeup(uring);
+  to_submit++;
+
+  while (!stop) {
+    int ret = uring_enter(uring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fatal(FN, "io_uring_enter() failed: %s", strerror(errno));
+    }
+
+    if (ret > 0) {
+      to_submit -= (unsigned)ret;
+    }
+
+    saldl_pthread_mutex_lock_retry_deadlock(&uring->mutex);
+
+    unsigned head = *uring->cq_head;
+    while (!uring->error && head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+      to_submit += uring_complete(uring, &cqes[head & *uring->cq_mask]);
+      head++;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    /* Errors are reported by the waiting threads, as fatal() joins some of them */
+    stop = uring->error || (uring->stop && !to_submit);
+
+    SALDL_ASSERT(!pthread_cond_broadcast(&uring->cond));
+    saldl_pthread_mutex_unlock(&uring->mutex);
+  }
+
+  return uring;
+}
+
+/* Called with the mutex locked */
+static void uring_check_error(uring_s *uring, const char *name) {
+  if (uring->error) {
+    int error = uring->error;
+    saldl_pthread_mutex_unlock(&uring->mutex);
+    fatal(FN, "Writing to %s through io_uring failed: %s", name, strerror(error));
+  }
+}
+
+static void* uring_mmap(int fd, size_t size, off_t offset) {
+  void *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, offset);
+
+  if (ptr == MAP_FAILED) {
+    fatal(FN, "mmap()ing io_uring rings failed: %s", strerror(errno));
+  }
+
+  return ptr;
+}
+
+static void uring_munmap(void *ptr, size_t size) {
+  if (munmap(ptr, size)) {
+    warn_msg(FN, "munmap()ing io_uring memory failed: %s", strerror(errno));
+  }
+}
+
+static void uring_bufs_init(uring_s *uring) {
+  struct iovec *iovecs = saldl_calloc(uring->buf_count, sizeof(struct iovec));
+
+  uring->bufs_mem_size = uring->buf_count * uring->buf_size;
+  uring->bufs_mem = mmap(NULL, uring->bufs_mem_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+  if (uring->bufs_mem == MAP_FAILED) {
+    fatal(FN, "mmap()ing io_uring buffers of size %"SAL_ZU" failed: %s", uring->bufs_mem_size, strerror(errno));
+  }
+
+  uring->bufs = saldl_calloc(uring->buf_count, sizeof(uring_buf_s));
+
+  for (size_t idx = 0; idx < uring->buf_count; idx++) {
+    uring_buf_s *buf = &uring->bufs[idx];
+    buf->data = uring->bufs_mem + idx * uring->buf_size;
+    buf->idx = (unsigned)idx;
+    buf->next_free = uring->free_bufs;
+    uring->free_bufs = buf;
+
+    iovecs[idx].iov_base = buf->data;
+    iovecs[idx].iov_len = uring->buf_size;
+  }
+
+  /* Pinning could exceed RLIMIT_MEMLOCK with old kernels, writes work without it */
+  if (uring_register(uring->fd, IORING_REGISTER_BUFFERS, iovecs, (unsigned)uring->buf_count)) {
+    info_msg(FN, "Registering io_uring buffers failed: %s", strerror(errno));
+  }
+  else {
+    uring->fixed_bufs = true;
+  }
+
+  SALDL_FREE(iovecs);
+}
+
+/* Returns false if io_uring is not usable, e.g. disabled or not supported by the kernel */
+bool uring_init(info_s *info_ptr) {
+  saldl_params *params_ptr = info_ptr->params;
+  uring_s *uring = &info_ptr->uring;
+  struct io_uring_params p;
+
+  uring->buf_count = info_ptr->thread_count * SALDL_URING_BUFS_PER_CONNECTION;
+  uring->buf_size = params_ptr->write_buf_size;
+
+  /* Plus the eventfd poll */
+  memset(&p, 0, sizeof(struct io_uring_params));
+  if ( (uring->fd = uring_setup((unsigned)uring->buf_count + 1, &p)) < 0 ) {
+    warn_msg(FN, "Setting up io_uring failed: %s, falling back to pwrite().", strerror(errno));
+    return false;
+  }
+
+  if ( (uring->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0 ) {
+    fatal(FN, "Creating an eventfd failed: %s", strerror(errno));
+  }
+
+  uring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  uring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  uring->sq_ring = uring_mmap(uring->fd, uring->sq_ring_size, IORING_OFF_SQ_RING);
+  uring->cq_ring = uring_mmap(uring->fd, uring->cq_ring_size, IORING_OFF_CQ_RING);
+  uring->sqes = uring_mmap(uring->fd, uring->sqes_size, IORING_OFF_SQES);
+
+  uring->sq_tail = (unsigned*)((char*)uring->sq_ring + p.sq_off.tail);
+  uring->sq_mask = (unsigned*)((char*)uring->sq_ring + p.sq_off.ring_mask);
+  uring->sq_array = (unsigned*)((char*)uring->sq_ring + p.sq_off.array);
+  uring->cq_head = (unsigned*)((char*)uring->cq_ring + p.cq_off.head);
+  uring->cq_tail = (unsigned*)((char*)uring->cq_ring + p.cq_off.tail);
+  uring->cq_mask = (unsigned*)((char*)uring->cq_ring + p.cq_off.ring_mask);
+  uring->cqes = (char*)uring->cq_ring + p.cq_off.cqes;
+
+  uring_bufs_init(uring);
+
+  SALDL_ASSERT(!pthread_mutex_init(&uring->mutex, NULL));
+  SALDL_ASSERT(!pthread_cond_init(&uring->cond, NULL));
+  saldl_pthread_create(&uring->pth, NULL, uring_thread, uring);
+
+  info_msg(FN, "io_uring set up with %"SAL_ZU" %s write buffers of size %.2f%s.", uring->buf_count,
+      uring->fixed_bufs ? "registered" : "unregistered",
+      human_size(uring->buf_size), human_size_suffix(uring->buf_size));
+
+  return true;
+}
+
+static void uring_wakeup(uring_s *uring) {
+  if (eventfd_write(uring->event_fd, 1)) {
+    fatal(FN, "Writing to io_uring eventfd failed: %s", strerror(errno));
+  }
+}
+
+/* Hand a chunk's filled buffer over to the uring thread */
+static void uring_submit_filled(uring_s *uring, direct_s *direct) {
+  uring_buf_s *buf = direct->buf;
+
+  direct->buf = NULL;
+
+  saldl_pthread_mutex_lock_retry_deadlock(&uring->mutex);
+  direct->in_flight++;
+  buf->next_free = uring->filled_bufs;
+  uring->filled_bufs = buf;
+  saldl_pthread_mutex_unlock(&uring->mutex);
+
+  uring_wakeup(uring);
+}
+
+/* Queue data received for a chunk, to be written at offset */
+void uring_write(direct_s *direct, const char *ptr, size_t size, off_t offset) {
+  uring_s *uring = direct->uring;
+
+  while (size) {
+    uring_buf_s *buf = direct->buf;
+
+    if (!buf) {
+      saldl_pthread_mutex_lock_retry_deadlock(&uring->mutex);
+      while (!uring->free_bufs && !uring->error) {
+        SALDL_ASSERT(!pthread_cond_wait(&uring->cond, &uring->mutex));
+      }
+      uring_check_error(uring, direct->name);
+      buf = uring->free_bufs;
+      uring->free_bufs = buf->next_free;
+      saldl_pthread_mutex_unlock(&uring->mutex);
+
+      buf->size = 0;
+      buf->written = 0;
+      buf->offset = offset;
+      buf->owner = direct;
+      direct->buf = buf;
+    }
+
+    /* Received data is contiguous */
+    SALDL_ASSERT(buf->offset + (off_t)buf->size == offset);
+
+    size_t copy_size = saldl_min(size, uring->buf_size - buf->size);
+    memcpy(buf->data + buf->size, ptr, copy_size);
+    buf->size += copy_size;
+    ptr += copy_size;
+    offset += (off_t)copy_size;
+    size -= copy_size;
+
+    if (buf->size == uring->buf_size) {
+      uring_submit_filled(uring, direct);
+    }
+  }
+}
+
+/* Submit what's left of a chunk's data, and wait for all its writes to complete */
+void uring_flush(direct_s *direct) {
+  uring_s *uring = direct->uring;
+
+  if (direct->buf) {
+    uring_submit_filled(uring, direct);
+  }
+
+  saldl_pthread_mutex_lock_retry_deadlock(&uring->mutex);
+  while (direct->in_flight && !uring->error) {
+    SALDL_ASSERT(!pthread_cond_wait(&uring->cond, &uring->mutex));
+  }
+  uring_check_error(uring, direct->name);
+  saldl_pthread_mutex_unlock(&uring->mutex);
+}
+
+void uring_free(uring_s *uring) {
+  if (!uring->bufs) {
+    return;
+  }
+
+  saldl_pthread_mutex_lock_retry_deadlock(&uring->mutex);
+  uring->stop = true;
+  saldl_pthread_mutex_unlock(&uring->mutex);
+
+  uring_wakeup(uring);
+  saldl_pthread_join_accept_einval(uring->pth, NULL);
+
+  uring_munmap(uring->bufs_mem, uring->bufs_mem_size);
+  uring_munmap(uring->sqes, uring->sqes_size);
+  uring_munmap(uring->cq_ring, uring->cq_ring_size);
+  uring_munmap(uring->sq_ring, uring->sq_ring_size);
+
+  if (close(uring->event_fd) || close(uring->fd)) {
+    warn_msg(FN, "Closing io_uring fds failed: %s", strerror(errno));
+  }
+
+  SALDL_FREE(uring->bufs);
+  SALDL_ASSERT(!pthread_cond_destroy(&uring->cond));
+  SALDL_ASSERT(!pthread_mutex_destroy(&uring->mutex));
+}
+
+#endif
+
+/* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
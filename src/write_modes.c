@@ -18,17 +18,41 @@
 */
 
 #include "write_modes.h"
-#include "merge.h" /* set_chunk_merged() */
+#include "merge.h" /* set_chunk_merged(), set_reorder_limit() */
+#include "multi.h" /* multi_wakeup() */
+#include "pool.h"
+#include "uring.h"
 
 #ifdef HAVE_MMAP
 #include <sys/mman.h>
 #endif
 
+#if defined(HAVE_O_DIRECT) || defined(HAVE_SPLICE) || defined(HAVE_VMSPLICE)
+#include <fcntl.h>
+#endif
+
+#if defined(HAVE_VMSPLICE) && defined(HAVE_IOCTL)
+#include <sys/ioctl.h> /* FIONREAD */
+#include <sys/uio.h>
+#include <poll.h>
+#define SALDL_VMSPLICE
+#endif
+
+#ifdef HAVE_FICLONERANGE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_SPLICE
+#include <sys/stat.h>
+#endif
+
 /* Default (tmp files) mode */
-static void prepare_storage_tmpf(chunk_s *chunk, file_s* dir) {
+static void prepare_storage_tmpf(chunk_s *chunk, file_s* dir, info_s *info_ptr) {
   SALDL_ASSERT(chunk);
   SALDL_ASSERT(dir);
   SALDL_ASSERT(dir->name);
+  SALDL_ASSERT(info_ptr);
 
   file_s *tmp_f = saldl_calloc (1, sizeof(file_s));
   tmp_f->name = saldl_calloc(PATH_MAX, sizeof(char));
@@ -38,7 +62,6 @@ static void prepare_storage_tmpf(chunk_s *chunk, file_s* dir) {
     if (! (tmp_f->file = fopen(tmp_f->name, "rb+"))) {
       fatal(FN, "Failed to open %s for read/write: %s", tmp_f->name, strerror(errno));
     }
-    saldl_fseeko(tmp_f->name, tmp_f->file, chunk->size_complete, SEEK_SET);
   }
   else {
     if (! (tmp_f->file = fopen(tmp_f->name, "wb+"))) {
@@ -46,6 +69,13 @@ static void prepare_storage_tmpf(chunk_s *chunk, file_s* dir) {
     }
   }
 
+  /* Coalesce libcurl's small writes, must be set before seeking */
+  tmp_f->buf = saldl_setvbuf(tmp_f->name, tmp_f->file, saldl_min(info_ptr->params->write_buf_size, chunk->size));
+
+  if (chunk->size_complete) {
+    saldl_fseeko(tmp_f->name, tmp_f->file, chunk->size_complete, SEEK_SET);
+  }
+
   chunk->storage = tmp_f;
 }
 
@@ -81,11 +111,195 @@ static size_t file_write_function(void  *ptr, size_t  size, size_t nmemb, void *
   SALDL_ASSERT(tmp_f->file);
   SALDL_ASSERT(tmp_f->name);
 
-  saldl_fwrite_fflush(ptr, size, nmemb, tmp_f->file, tmp_f->name, 0);
+  if (tmp_f->buf) {
+    saldl_fwrite(ptr, size, nmemb, tmp_f->file, tmp_f->name, 0);
+  }
+  else {
+    saldl_fwrite_fflush(ptr, size, nmemb, tmp_f->file, tmp_f->name, 0);
+  }
 
   return realsize;
 }
 
+/* Write merged data at its offset in the output */
+static void merge_write(info_s *info_ptr, const void *buf, size_t size, off_t offset) {
+#ifdef HAVE_PWRITE
+  /* Merge workers share the part file, positional writes don't move a shared file position */
+  if (info_ptr->params->merge_workers) {
+    saldl_pwrite_all(info_ptr->part_filename, fileno(info_ptr->file), buf, size, offset);
+    return;
+  }
+#endif
+
+  if (!info_ptr->params->to_stdout) {
+    saldl_fseeko(info_ptr->part_filename, info_ptr->file, offset, SEEK_SET);
+  }
+
+  saldl_fwrite_fflush(buf, 1, size, info_ptr->file, info_ptr->part_filename, offset);
+}
+
+/* The fastest in-kernel merging supported by this build */
+static enum MERGE_COPY merge_copy_best(info_s *info_ptr) {
+  if (info_ptr->params->to_stdout) {
+#ifdef HAVE_SPLICE
+    /* Chunk data can only be spliced to a pipe */
+    struct stat st;
+    if (!fstat(fileno(info_ptr->file), &st) && S_ISFIFO(st.st_mode)) {
+      return MERGE_COPY_SPLICE;
+    }
+#endif
+    return MERGE_COPY_NONE;
+  }
+
+#ifdef HAVE_FICLONERANGE
+  /* Cloned ranges must be block aligned, assume 4k blocks */
+  if (!(info_ptr->params->chunk_size % 4096)) {
+    return MERGE_COPY_CLONE;
+  }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  return MERGE_COPY_FILE_RANGE;
+#else
+  return MERGE_COPY_NONE;
+#endif
+}
+
+static const char *merge_copy_str[] = { "mmap()/fread()", "copy_file_range()", "FICLONERANGE", "splice()/vmsplice()" };
+
+/* Stop trying a method that failed, e.g. not supported by the filesystem */
+static void merge_copy_lower(info_s *info_ptr, enum MERGE_COPY failed) {
+  enum MERGE_COPY lower = MERGE_COPY_NONE;
+  int failed_errno = errno;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  if (failed == MERGE_COPY_CLONE) {
+    lower = MERGE_COPY_FILE_RANGE;
+  }
+#endif
+
+  if (__atomic_compare_exchange_n(&info_ptr->merge_copy, &failed, lower, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    info_msg(FN, "Merging with %s failed: %s, using %s.", merge_copy_str[failed], strerror(failed_errno), merge_copy_str[lower]);
+  }
+}
+
+#ifdef HAVE_SPLICE
+/* Wait for the pipe's reader to consume the remaining spliced pages, or to close its end */
+static void vmspliced_drain(info_s *info_ptr) {
+  spliced_bufs_s *spliced = &info_ptr->spliced_bufs;
+  struct pollfd pfd = { .fd = fileno(info_ptr->file), .events = 0 };
+  int unread = 0;
+
+  while (spliced->count && !ioctl(pfd.fd, FIONREAD, &unread) && unread) {
+    /* Only POLLERR is reported, when there is no reader left */
+    if (poll(&pfd, 1, SALDL_SPLICED_DRAIN_POLL_MS) > 0) {
+      break;
+    }
+  }
+
+  for (size_t idx = 0; idx < spliced->count; idx++) {
+    mem_pool_return(&info_ptr->mem_pool, spliced->bufs[idx]);
+  }
+  spliced->count = 0;
+}
+
+/* Returns non-zero if nothing was moved to the pipe, and the chunk should be written by fwrite() */
+static int splice_to_stdout(info_s *info_ptr, int fd_in, size_t size) {
+  loff_t off_in = 0;
+  size_t rem = size;
+
+  while (rem) {
+    ssize_t ret = splice(fd_in, &off_in, fileno(info_ptr->file), NULL, rem, SPLICE_F_MOVE);
+
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (ret <= 0) {
+      /* Data written to a pipe can't be overwritten by the fallback */
+      if (ret < 0 && rem == size) {
+        merge_copy_lower(info_ptr, MERGE_COPY_SPLICE);
+        return -1;
+      }
+      fatal(FN, "Splicing chunk data to stdout failed: %s", ret ? strerror(errno) : "Unexpected end of tmp file");
+    }
+
+    rem -= (size_t)ret;
+  }
+
+  return 0;
+}
+#endif
+
+/* Let the kernel copy the chunk, or share its extents with the part file.
+ * Returns non-zero if the chunk should be copied through user space. */
+static int tmpf_write_use_kernel(chunk_s *chunk, info_s *info_ptr, off_t offset) {
+  file_s *tmp_f = chunk->storage;
+  enum MERGE_COPY copy = __atomic_load_n(&info_ptr->merge_copy, __ATOMIC_ACQUIRE);
+
+  SALDL_ASSERT(tmp_f);
+  SALDL_ASSERT(tmp_f->file);
+  SALDL_ASSERT(chunk->size);
+
+#ifdef HAVE_SPLICE
+  if (copy == MERGE_COPY_SPLICE) {
+    return splice_to_stdout(info_ptr, fileno(tmp_f->file), chunk->size);
+  }
+#endif
+
+#ifdef HAVE_FICLONERANGE
+  if (copy == MERGE_COPY_CLONE) {
+    struct file_clone_range range = {
+      .src_fd = fileno(tmp_f->file),
+      .src_offset = 0,
+      .src_length = chunk->size,
+      .dest_offset = (uint64_t)offset
+    };
+
+    if (!ioctl(fileno(info_ptr->file), FICLONERANGE, &range)) {
+      return 0;
+    }
+
+    /* EINVAL: this range can't be cloned, e.g. the unaligned end of the last chunk */
+    if (errno != EINVAL) {
+      merge_copy_lower(info_ptr, copy);
+    }
+
+    /* Copy this chunk with the next method, the read/write copy if there is none */
+#ifdef HAVE_COPY_FILE_RANGE
+    copy = MERGE_COPY_FILE_RANGE;
+#endif
+  }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  if (copy == MERGE_COPY_FILE_RANGE) {
+    loff_t off_in = 0;
+    loff_t off_out = offset;
+    size_t rem = chunk->size;
+
+    while (rem) {
+      ssize_t ret = copy_file_range(fileno(tmp_f->file), &off_in, fileno(info_ptr->file), &off_out, rem, 0);
+
+      if (ret <= 0) {
+        /* A partial copy is overwritten by the fallback */
+        if (ret < 0) {
+          merge_copy_lower(info_ptr, copy);
+        }
+        return -1;
+      }
+
+      rem -= (size_t)ret;
+    }
+
+    return 0;
+  }
+#endif
+
+  (void)offset;
+  return -1;
+}
+
 static int tmpf_write_use_mmap(chunk_s *chunk, info_s *info_ptr, off_t offset) {
   SALDL_ASSERT(chunk);
   SALDL_ASSERT(info_ptr);
@@ -108,7 +322,7 @@ static int tmpf_write_use_mmap(chunk_s *chunk, info_s *info_ptr, off_t offset) {
     return -2;
   }
 
-  saldl_fwrite_fflush(tmp_buf, 1, chunk->size, info_ptr->file, info_ptr->part_filename, offset);
+  merge_write(info_ptr, tmp_buf, chunk->size, offset);
 
   if (munmap(tmp_buf, chunk->size)) {
     warn_msg(FN, "munmap()ing chunk file %"SAL_ZU" failed.", chunk->idx);
@@ -134,7 +348,7 @@ static int merge_finished_tmpf(chunk_s *chunk, info_s *info_ptr) {
   SALDL_ASSERT(info_ptr->params);
   SALDL_ASSERT(info_ptr->params->chunk_size);
 
-  off_t offset = (off_t)chunk->idx * info_ptr->params->chunk_size;
+  off_t offset = chunk->range_start;
 
   SALDL_ASSERT(info_ptr->file);
   SALDL_ASSERT(info_ptr->part_filename);
@@ -142,14 +356,11 @@ static int merge_finished_tmpf(chunk_s *chunk, info_s *info_ptr) {
   saldl_fseeko(tmp_f->name, tmp_f->file, 0, SEEK_SET);
   saldl_fflush(tmp_f->name, tmp_f->file);
 
-  if (!info_ptr->params->to_stdout) {
-    saldl_fseeko(info_ptr->part_filename, info_ptr->file, offset, SEEK_SET);
-  }
-
   SALDL_ASSERT(chunk->size);
 
 
-  if (info_ptr->params->no_mmap || tmpf_write_use_mmap(chunk, info_ptr, offset)) {
+  if (tmpf_write_use_kernel(chunk, info_ptr, offset) &&
+      (info_ptr->params->no_mmap || tmpf_write_use_mmap(chunk, info_ptr, offset))) {
     size_t size = chunk->size;
     char *tmp_buf = saldl_calloc(size, sizeof(char));
 
@@ -158,7 +369,7 @@ static int merge_finished_tmpf(chunk_s *chunk, info_s *info_ptr) {
       fatal(FN, "Reading from tmp file %s at offset %"SAL_JD" failed, chunk_size=%"SAL_ZU", fread() returned %"SAL_ZU".", tmp_f->name, (intmax_t)offset, size, f_ret);
     }
 
-    saldl_fwrite_fflush(tmp_buf, 1, size, info_ptr->file, info_ptr->part_filename, offset);
+    merge_write(info_ptr, tmp_buf, size, offset);
 
     SALDL_FREE(tmp_buf);
   }
@@ -170,6 +381,7 @@ static int merge_finished_tmpf(chunk_s *chunk, info_s *info_ptr) {
     fatal(FN, "Removing file %s failed: %s", tmp_f->name, strerror(errno));
   }
 
+  SALDL_FREE(tmp_f->buf);
   SALDL_FREE(tmp_f->name);
   SALDL_FREE(tmp_f);
 
@@ -177,12 +389,14 @@ static int merge_finished_tmpf(chunk_s *chunk, info_s *info_ptr) {
 }
 
 /* Memory (buffers) mode */
-static void prepare_storage_mem(chunk_s *chunk) {
+static void prepare_storage_mem(chunk_s *chunk, file_s *unused, info_s *info_ptr) {
   SALDL_ASSERT(chunk);
   SALDL_ASSERT(chunk->size);
+  SALDL_ASSERT(chunk->size <= info_ptr->mem_pool.buf_size);
+  (void)unused;
 
   mem_s *buf = saldl_calloc (1, sizeof(mem_s));
-  buf->memory = saldl_calloc(chunk->size, sizeof(char));
+  buf->memory = mem_pool_get(&info_ptr->mem_pool);
   buf->allocated_size = chunk->size;
   chunk->storage = buf;
 }
@@ -191,6 +405,11 @@ static void reset_storage_mem(thread_s *thread) {
   mem_s *buf = thread->chunk->storage;
   SALDL_ASSERT(buf);
   buf->size = 0;
+
+  /* range_end might have been shrunk by work stealing */
+  SALDL_ASSERT(thread->ehandle);
+  thread->chunk->size_complete = 0;
+  curl_set_ranges(thread->ehandle, thread->chunk);
 }
 
 static size_t  mem_write_function(void  *ptr,  size_t  size, size_t nmemb, void *data) {
@@ -211,12 +430,90 @@ static size_t  mem_write_function(void  *ptr,  size_t  size, size_t nmemb, void
   return realsize;
 }
 
+#ifdef SALDL_VMSPLICE
+/* Pages vmsplice()d to the pipe are only referenced, their buffers are returned to the pool after they're read */
+static void vmspliced_return_read(info_s *info_ptr) {
+  spliced_bufs_s *spliced = &info_ptr->spliced_bufs;
+  int unread = 0;
+  size_t read_count = 0;
+
+  if (!spliced->count) {
+    return;
+  }
+
+  if (ioctl(fileno(info_ptr->file), FIONREAD, &unread)) {
+    debug_msg(FN, "ioctl(FIONREAD) on stdout failed: %s", strerror(errno));
+    return;
+  }
+
+  while (read_count < spliced->count && spliced->ends[read_count] <= spliced->total - (uint64_t)unread) {
+    mem_pool_return(&info_ptr->mem_pool, spliced->bufs[read_count]);
+    read_count++;
+  }
+
+  spliced->count -= read_count;
+  memmove(spliced->bufs, spliced->bufs + read_count, spliced->count * sizeof(char*));
+  memmove(spliced->ends, spliced->ends + read_count, spliced->count * sizeof(uint64_t));
+}
+
+/* Returns non-zero if nothing was moved to the pipe, and the chunk should be written by fwrite() */
+static int vmsplice_to_stdout(info_s *info_ptr, char *buf, size_t size) {
+  spliced_bufs_s *spliced = &info_ptr->spliced_bufs;
+  struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+  while (iov.iov_len) {
+    ssize_t ret = vmsplice(fileno(info_ptr->file), &iov, 1, 0);
+
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (ret <= 0) {
+      if (ret < 0 && iov.iov_len == size) {
+        merge_copy_lower(info_ptr, MERGE_COPY_SPLICE);
+        return -1;
+      }
+      fatal(FN, "vmsplice()ing chunk data to stdout failed: %s", ret ? strerror(errno) : "Nothing written");
+    }
+
+    iov.iov_base = (char*)iov.iov_base + ret;
+    iov.iov_len -= (size_t)ret;
+  }
+
+  if (spliced->count == spliced->capacity) {
+    spliced->capacity = saldl_max(2 * spliced->capacity, 4);
+    spliced->bufs = spliced->bufs ? saldl_realloc(spliced->bufs, spliced->capacity * sizeof(char*)) : saldl_calloc(spliced->capacity, sizeof(char*));
+    spliced->ends = spliced->ends ? saldl_realloc(spliced->ends, spliced->capacity * sizeof(uint64_t)) : saldl_calloc(spliced->capacity, sizeof(uint64_t));
+  }
+
+  spliced->total += size;
+  spliced->bufs[spliced->count] = buf;
+  spliced->ends[spliced->count] = spliced->total;
+  spliced->count++;
+
+  /* Not to be counted towards the memory buffers limit, lent buffers are bounded by the pipe size */
+  mem_pool_lend(&info_ptr->mem_pool);
+
+  return 0;
+}
+#endif
+
+/* Return buffers still lent to the stdout pipe to the memory pool, before it's freed */
+void spliced_bufs_free(info_s *info_ptr) {
+#ifdef SALDL_VMSPLICE
+  vmspliced_drain(info_ptr);
+#endif
+
+  SALDL_FREE(info_ptr->spliced_bufs.bufs);
+  SALDL_FREE(info_ptr->spliced_bufs.ends);
+}
+
 static int merge_finished_mem(chunk_s *chunk, info_s *info_ptr) {
   SALDL_ASSERT(chunk);
   SALDL_ASSERT(info_ptr);
 
   size_t size = chunk->size;
-  off_t offset = (off_t)chunk->idx * info_ptr->params->chunk_size;
+  off_t offset = chunk->range_start;
 
   mem_s *buf = chunk->storage;
 
@@ -224,20 +521,304 @@ static int merge_finished_mem(chunk_s *chunk, info_s *info_ptr) {
   SALDL_ASSERT(info_ptr->params);
   SALDL_ASSERT(info_ptr->params->chunk_size);
 
-  if (!info_ptr->params->to_stdout) {
-    saldl_fseeko(info_ptr->part_filename, info_ptr->file, offset, SEEK_SET);
+  bool spliced = false;
+
+#ifdef SALDL_VMSPLICE
+  if (__atomic_load_n(&info_ptr->merge_copy, __ATOMIC_ACQUIRE) == MERGE_COPY_SPLICE) {
+    vmspliced_return_read(info_ptr);
+    spliced = !vmsplice_to_stdout(info_ptr, buf->memory, size);
   }
+#endif
 
-  saldl_fwrite_fflush(buf->memory, 1, size, info_ptr->file, info_ptr->part_filename, offset);
+  if (!spliced) {
+    if (!info_ptr->params->to_stdout) {
+      saldl_fseeko(info_ptr->part_filename, info_ptr->file, offset, SEEK_SET);
+    }
+
+    saldl_fwrite_fflush(buf->memory, 1, size, info_ptr->file, info_ptr->part_filename, offset);
+    mem_pool_put(&info_ptr->mem_pool, buf->memory);
+  }
 
-  SALDL_FREE(buf->memory);
   SALDL_FREE(buf);
 
   set_chunk_merged(chunk);
 
+  /* An idle connection could be waiting for a buffer */
+  if (info_ptr->params->mem_bufs_limit) {
+    multi_wakeup(info_ptr);
+  }
+
+  return 0;
+}
+
+/* Direct (positional writes) mode */
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+static void prepare_storage_direct(chunk_s *chunk, file_s *part_file, info_s *info_ptr) {
+  SALDL_ASSERT(chunk);
+  SALDL_ASSERT(part_file);
+  SALDL_ASSERT(part_file->file);
+  SALDL_ASSERT(part_file->name);
+
+  direct_s *direct = saldl_calloc(1, sizeof(direct_s));
+  direct->name = part_file->name;
+  direct->fd = fileno(part_file->file);
+  direct->offset = chunk->range_start + (off_t)chunk->size_complete;
+  direct->range_end = chunk->range_end;
+
+  if (info_ptr->params->io_uring) {
+    direct->uring = &info_ptr->uring;
+  }
+
+#ifdef HAVE_MMAP
+  if (info_ptr->params->mmap_writes) {
+    off_t page_size = (off_t)sysconf(_SC_PAGESIZE);
+
+    /* The part file was already sized, mapped offsets must be page aligned */
+    direct->map_offset = chunk->range_start / page_size * page_size;
+    direct->map_size = (size_t)(chunk->range_end + 1 - direct->map_offset);
+    direct->map = mmap(NULL, direct->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, direct->fd, direct->map_offset);
+
+    if (direct->map == MAP_FAILED) {
+      fatal(FN, "mmap()ing chunk %"SAL_ZU" of %s failed: %s", chunk->idx, part_file->name, strerror(errno));
+    }
+
+#ifdef MADV_SEQUENTIAL
+    /* Not fatal, it only tunes read-ahead of the pages faulted in before they are written */
+    if (madvise(direct->map, direct->map_size, MADV_SEQUENTIAL)) {
+      debug_msg(FN, "madvise(MADV_SEQUENTIAL) failed: %s", strerror(errno));
+    }
+#endif
+  }
+#endif
+
+  direct->o_direct_fd = -1;
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+  if (info_ptr->params->o_direct) {
+    size_t align = info_ptr->o_direct_align;
+    direct->o_direct_fd = info_ptr->o_direct_fd;
+    direct->o_direct_align = align;
+    direct->aligned_buf_size = (saldl_min(info_ptr->params->write_buf_size, chunk->size) + align - 1) / align * align;
+    direct->aligned_buf = saldl_aligned_malloc(align, direct->aligned_buf_size);
+  }
+#endif
+
+  chunk->storage = direct;
+}
+
+static void reset_storage_direct(thread_s *thread) {
+  SALDL_ASSERT(thread);
+  SALDL_ASSERT(thread->chunk);
+
+  direct_s *direct = thread->chunk->storage;
+  SALDL_ASSERT(direct);
+
+  /* Unlike tmp files, we know exactly how much was written */
+  thread->chunk->size_complete = (size_t)(direct->offset - thread->chunk->range_start);
+
+  SALDL_ASSERT(thread->ehandle);
+  curl_set_ranges(thread->ehandle, thread->chunk);
+
+  info_msg(FN, "restarting chunk %"SAL_ZU" from offset %"SAL_ZU"", thread->chunk->idx, thread->chunk->size_complete);
+}
+
+static size_t direct_write_function(void  *ptr, size_t  size, size_t nmemb, void *data) {
+  size_t realsize = size * nmemb;
+  direct_s *direct = data;
+
+  SALDL_ASSERT(ptr);
+  SALDL_ASSERT(direct);
+  SALDL_ASSERT(direct->name);
+
+  /* Never overwrite data belonging to other chunks */
+  if (direct->offset + (off_t)realsize - 1 > direct->range_end) {
+    fatal(FN, "Received data exceeds the requested range (ends at %"SAL_JD"), this is a sign of a bad server, retry with a single connection.", (intmax_t)direct->range_end);
+  }
+
+  saldl_pwrite_all(direct->name, direct->fd, ptr, realsize, direct->offset);
+  direct->offset += (off_t)realsize;
+
+  return realsize;
+}
+
+#ifdef HAVE_IO_URING
+static size_t uring_write_function(void  *ptr, size_t  size, size_t nmemb, void *data) {
+  size_t realsize = size * nmemb;
+  direct_s *direct = data;
+
+  SALDL_ASSERT(ptr);
+  SALDL_ASSERT(direct);
+  SALDL_ASSERT(direct->uring);
+
+  /* Never overwrite data belonging to other chunks */
+  if (direct->offset + (off_t)realsize - 1 > direct->range_end) {
+    fatal(FN, "Received data exceeds the requested range (ends at %"SAL_JD"), this is a sign of a bad server, retry with a single connection.", (intmax_t)direct->range_end);
+  }
+
+  /* Queued data counts as written, a restarted transfer continues after it */
+  uring_write(direct, ptr, realsize, direct->offset);
+  direct->offset += (off_t)realsize;
+
+  return realsize;
+}
+#endif
+
+#ifdef HAVE_MMAP
+static size_t mmap_write_function(void  *ptr, size_t  size, size_t nmemb, void *data) {
+  size_t realsize = size * nmemb;
+  direct_s *direct = data;
+
+  SALDL_ASSERT(ptr);
+  SALDL_ASSERT(direct);
+  SALDL_ASSERT(direct->map);
+
+  /* Never overwrite data belonging to other chunks */
+  if (direct->offset + (off_t)realsize - 1 > direct->range_end) {
+    fatal(FN, "Received data exceeds the requested range (ends at %"SAL_JD"), this is a sign of a bad server, retry with a single connection.", (intmax_t)direct->range_end);
+  }
+
+  memcpy(direct->map + (direct->offset - direct->map_offset), ptr, realsize);
+  direct->offset += (off_t)realsize;
+
+  return realsize;
+}
+
+/* Write back the chunk's window before the ctrl file marks it merged */
+static void mmap_writes_finish(direct_s *direct) {
+  if (msync(direct->map, direct->map_size, MS_SYNC)) {
+    fatal(FN, "msync()ing a chunk of %s failed: %s", direct->name, strerror(errno));
+  }
+
+  if (munmap(direct->map, direct->map_size)) {
+    warn_msg(FN, "munmap()ing a chunk of %s failed: %s", direct->name, strerror(errno));
+  }
+
+  direct->map = NULL;
+}
+#endif
+
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+static void o_direct_flush(direct_s *direct) {
+  size_t align = direct->o_direct_align;
+  size_t direct_size = 0;
+
+  /* Only aligned offsets and sizes can be written with O_DIRECT */
+  if (!(direct->aligned_buf_offset % (off_t)align)) {
+    direct_size = direct->aligned_buf_used / align * align;
+    if (direct_size) {
+      saldl_pwrite_all(direct->name, direct->o_direct_fd, direct->aligned_buf, direct_size, direct->aligned_buf_offset);
+    }
+  }
+
+  /* The tail of the last chunk, or a sub-chunk split at an unaligned offset, goes through the page cache */
+  if (direct->aligned_buf_used > direct_size) {
+    saldl_pwrite_all(direct->name, direct->fd, direct->aligned_buf + direct_size,
+        direct->aligned_buf_used - direct_size, direct->aligned_buf_offset + (off_t)direct_size);
+  }
+
+  direct->aligned_buf_used = 0;
+}
+
+static size_t o_direct_write_function(void  *ptr, size_t  size, size_t nmemb, void *data) {
+  size_t realsize = size * nmemb;
+  size_t copied = 0;
+  direct_s *direct = data;
+
+  SALDL_ASSERT(ptr);
+  SALDL_ASSERT(direct);
+  SALDL_ASSERT(direct->aligned_buf);
+
+  /* Never overwrite data belonging to other chunks */
+  if (direct->offset + (off_t)realsize - 1 > direct->range_end) {
+    fatal(FN, "Received data exceeds the requested range (ends at %"SAL_JD"), this is a sign of a bad server, retry with a single connection.", (intmax_t)direct->range_end);
+  }
+
+  while (copied < realsize) {
+    size_t copy_size = saldl_min(realsize - copied, direct->aligned_buf_size - direct->aligned_buf_used);
+
+    if (!direct->aligned_buf_used) {
+      direct->aligned_buf_offset = direct->offset + (off_t)copied;
+    }
+
+    memcpy(direct->aligned_buf + direct->aligned_buf_used, (char*)ptr + copied, copy_size);
+    direct->aligned_buf_used += copy_size;
+    copied += copy_size;
+
+    if (direct->aligned_buf_used == direct->aligned_buf_size) {
+      o_direct_flush(direct);
+    }
+  }
+
+  /* Buffered data counts as written, a restarted transfer continues after it */
+  direct->offset += (off_t)realsize;
+
+  return realsize;
+}
+#endif
+
+static int merge_finished_direct(chunk_s *chunk, info_s *info_ptr) {
+  SALDL_ASSERT(chunk);
+  (void) info_ptr;
+
+#ifdef HAVE_MMAP
+  direct_s *mapped = chunk->storage;
+  if (mapped->map) {
+    mmap_writes_finish(mapped);
+  }
+#endif
+
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+  direct_s *o_direct = chunk->storage;
+  if (o_direct->aligned_buf) {
+    o_direct_flush(o_direct);
+    SALDL_FREE(o_direct->aligned_buf);
+  }
+#endif
+
+#ifdef HAVE_IO_URING
+  /* Not merged before all its writes complete */
+  direct_s *direct = chunk->storage;
+  if (direct->uring) {
+    uring_flush(direct);
+  }
+#endif
+
+  /* Data is already in place, only bookkeeping is left */
+  SALDL_FREE(chunk->storage);
+  set_chunk_merged(chunk);
+
   return 0;
 }
 
+/* Endgame: complete the pending writes of a chunk that won against its hedge,
+ * as the hedge is set merged with no data of its own once it's stopped. */
+void flush_storage_direct(chunk_s *chunk) {
+  SALDL_ASSERT(chunk);
+  SALDL_ASSERT(chunk->storage);
+
+#if defined(HAVE_MMAP) || (defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)) || defined(HAVE_IO_URING)
+  direct_s *direct = chunk->storage;
+#endif
+
+#ifdef HAVE_MMAP
+  if (direct->map && msync(direct->map, direct->map_size, MS_SYNC)) {
+    fatal(FN, "msync()ing chunk %"SAL_ZU" of %s failed: %s", chunk->idx, direct->name, strerror(errno));
+  }
+#endif
+
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+  if (direct->aligned_buf) {
+    o_direct_flush(direct);
+  }
+#endif
+
+#ifdef HAVE_IO_URING
+  if (direct->uring) {
+    uring_flush(direct);
+  }
+#endif
+}
+#endif
+
 /* Single mode */
 static void prepare_storage_single(chunk_s *chunk, file_s *part_file) {
   SALDL_ASSERT(chunk);
@@ -262,6 +843,8 @@ static void reset_storage_single(thread_s *thread) {
   SALDL_ASSERT(storage->name);
   SALDL_ASSERT(storage->file);
 
+  saldl_fflush(storage->name, storage->file);
+
   off_t offset = saldl_max_o(saldl_fsizeo(storage->name, storage->file), 4096) - 4096;
 
   SALDL_ASSERT(thread->ehandle);
@@ -307,6 +890,40 @@ static int merge_finished_null(chunk_s *chunk) {
   return 0;
 }
 
+/* Work stealing, zero-probe & reorder window */
+static size_t thread_write_function(void  *ptr, size_t  size, size_t nmemb, void *data) {
+  thread_s *thread = data;
+  chunk_s *chunk = thread->chunk;
+  size_t realsize = size * nmemb;
+  size_t accepted = 0;
+  off_t offset;
+
+  SALDL_ASSERT(chunk);
+  SALDL_ASSERT(thread->write_function);
+
+  /* Too far ahead of merging, chunk_progress() continues the transfer when the window moves */
+  if (thread->reorder_limit && chunk->curr_pos >= __atomic_load_n(thread->reorder_limit, __ATOMIC_ACQUIRE)) {
+    thread->reorder_paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  /* Reserve what fits before range_end, a thief can only split after curr_pos */
+  saldl_pthread_mutex_lock_retry_deadlock(&thread->range_mutex);
+  offset = chunk->curr_pos;
+  if (offset <= chunk->range_end && !__atomic_load_n(&chunk->hedge_lost, __ATOMIC_ACQUIRE)) {
+    accepted = (size_t)saldl_min_o((off_t)realsize, chunk->range_end - offset + 1);
+    chunk->curr_pos += (off_t)accepted;
+  }
+  saldl_pthread_mutex_unlock(&thread->range_mutex);
+
+  if (accepted) {
+    thread->write_function(ptr, (size_t)1, accepted, chunk->storage);
+  }
+
+  /* Accepting less than realsize stops the transfer (CURLE_WRITE_ERROR) */
+  return accepted;
+}
+
 /* Setters */
 
 void set_modes(info_s *info_ptr) {
@@ -316,11 +933,13 @@ void set_modes(info_s *info_ptr) {
   saldl_params *params_ptr = info_ptr->params;
   file_s *storage_info_ptr = &info_ptr->storage_info;
   void(*reset_storage)();
+  size_t(*write_function)() = NULL;
 
   if (params_ptr->read_only) {
     info_ptr->prepare_storage = &prepare_storage_null;
     info_ptr->merge_finished = &merge_finished_null;
     reset_storage = &reset_storage_null;
+    write_function = &null_write_function;
   }
   else if (params_ptr->single_mode) {
     info_msg(FN, "single mode, writing to %s directly.", info_ptr->part_filename);
@@ -336,20 +955,85 @@ void set_modes(info_s *info_ptr) {
     }
   }
   else if (params_ptr->mem_bufs) {
+    mem_pool_init(info_ptr);
+#ifdef SALDL_VMSPLICE
+    if (params_ptr->to_stdout) {
+      info_ptr->merge_copy = merge_copy_best(info_ptr);
+    }
+#endif
     info_ptr->prepare_storage = &prepare_storage_mem;
     info_ptr->merge_finished = &merge_finished_mem;
     reset_storage = &reset_storage_mem;
+    write_function = &mem_write_function;
+  }
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+  else if (params_ptr->direct_writes) {
+    info_msg(FN, "direct writes, writing chunks to %s at their offsets.", info_ptr->part_filename);
+    storage_info_ptr->name = info_ptr->part_filename;
+    storage_info_ptr->file = info_ptr->file;
+
+    /* Size the part file once, chunks are then written in place */
+    saldl_ftruncate(info_ptr->part_filename, fileno(info_ptr->file), info_ptr->file_size);
+
+    info_ptr->prepare_storage = &prepare_storage_direct;
+    info_ptr->merge_finished = &merge_finished_direct;
+    reset_storage = &reset_storage_direct;
+    write_function = &direct_write_function;
+
+#ifdef HAVE_IO_URING
+    /* Falls back to pwrite() if the running kernel doesn't support io_uring */
+    if (params_ptr->io_uring && (params_ptr->io_uring = uring_init(info_ptr))) {
+      write_function = &uring_write_function;
+    }
+#endif
+
+#ifdef HAVE_MMAP
+    if (params_ptr->mmap_writes) {
+      info_msg(FN, "mmap writes, copying received data to mapped chunks of %s.", info_ptr->part_filename);
+      write_function = &mmap_write_function;
+    }
+#endif
+
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+    if (params_ptr->o_direct) {
+      if ( (info_ptr->o_direct_fd = open(info_ptr->part_filename, O_WRONLY|O_DIRECT)) < 0 ) {
+        warn_msg(FN, "Opening %s with O_DIRECT failed: %s, falling back to buffered writes.", info_ptr->part_filename, strerror(errno));
+        params_ptr->o_direct = false;
+      }
+      else {
+        info_msg(FN, "Writing to %s with O_DIRECT, aligned to %"SAL_ZU" bytes.", info_ptr->part_filename, info_ptr->o_direct_align);
+        write_function = &o_direct_write_function;
+      }
+    }
+#endif
   }
+#endif
   else {
     storage_info_ptr->name = info_ptr->tmp_dirname;
+    info_ptr->merge_copy = merge_copy_best(info_ptr);
     info_ptr->prepare_storage = &prepare_storage_tmpf;
     info_ptr->merge_finished = &merge_finished_tmpf;
     reset_storage = &reset_storage_tmpf;
+    write_function = &file_write_function;
   }
 
-  /* set *reset_storage() in thread struct instances */
-  for (size_t counter = 0; counter < params_ptr->num_connections; counter++) {
+  /* set *reset_storage() & *write_function() in thread struct instances */
+  for (size_t counter = 0; counter < info_ptr->thread_count; counter++) {
     info_ptr->threads[counter].reset_storage = reset_storage;
+    info_ptr->threads[counter].write_function = write_function;
+
+    if (params_ptr->work_stealing || params_ptr->endgame || params_ptr->zero_probe || params_ptr->reorder_window) {
+      SALDL_ASSERT(write_function || params_ptr->single_mode);
+      SALDL_ASSERT(!pthread_mutex_init(&info_ptr->threads[counter].range_mutex, NULL));
+    }
+
+    if (params_ptr->reorder_window) {
+      info_ptr->threads[counter].reorder_limit = &info_ptr->reorder_limit;
+    }
+  }
+
+  if (params_ptr->reorder_window) {
+    set_reorder_limit(info_ptr);
   }
 }
 
@@ -372,9 +1056,44 @@ void set_write_opts(CURL* handle, void* storage, saldl_params *params_ptr, bool
   else if (params_ptr->mem_bufs) {
     curl_easy_setopt(handle,CURLOPT_WRITEFUNCTION,mem_write_function);
   }
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+#ifdef HAVE_IO_URING
+  else if (params_ptr->io_uring) {
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, uring_write_function);
+  }
+#endif
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+  else if (params_ptr->o_direct) {
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, o_direct_write_function);
+  }
+#endif
+#ifdef HAVE_MMAP
+  else if (params_ptr->mmap_writes) {
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, mmap_write_function);
+  }
+#endif
+  else if (params_ptr->direct_writes) {
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, direct_write_function);
+  }
+#endif
   else {
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, file_write_function);
   }
 }
 
+void set_chunk_write_opts(thread_s *thread, saldl_params *params_ptr) {
+  SALDL_ASSERT(thread);
+  SALDL_ASSERT(thread->chunk);
+
+  if (params_ptr->work_stealing || params_ptr->endgame || thread->reorder_limit || (thread->open_ended && thread->write_function)) {
+    /* Writes go through the thread, to be clipped at the chunk's current range_end,
+     * stopped if an endgame copy won, or paused at the end of the reorder window */
+    curl_easy_setopt(thread->ehandle, CURLOPT_WRITEDATA, thread);
+    curl_easy_setopt(thread->ehandle, CURLOPT_WRITEFUNCTION, thread_write_function);
+  }
+  else {
+    set_write_opts(thread->ehandle, thread->chunk->storage, params_ptr, false);
+  }
+}
+
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */
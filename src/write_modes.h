@@ -27,5 +27,10 @@
 
 void set_modes(info_s *info_ptr);
 void set_write_opts(CURL* handle, void* storage, saldl_params *params_ptr, bool no_body);
+void set_chunk_write_opts(thread_s *thread, saldl_params *params_ptr);
+void spliced_bufs_free(info_s *info_ptr);
+#if defined(HAVE_PWRITE) && defined(HAVE_FTRUNCATE)
+void flush_storage_direct(chunk_s *chunk);
+#endif
 
 /* vim: set filetype=c ts=2 sw=2 et spell foldmethod=syntax: */